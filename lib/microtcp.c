@@ -20,15 +20,65 @@
 
 #include "microtcp.h"
 #include "../utils/crc32.h"
+#include "../utils/histogram.h"
+#include "../utils/timer_wheel.h"
+#include "../utils/lz.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #define  MAX_PAYLOAD_SIZE  (MICROTCP_MSS-sizeof(microtcp_header_t))
+#define  SEGMENT_PAYLOAD(s)  ((s)->mss-sizeof(microtcp_header_t))
+#define  SYN_COMPRESS  (1U<<24)   /* In the MSS field of SYN/SYNACK, the sender asks for compression */
+#define  ZSKIP_MAX  64            /* Most segments sent uncompressed after a failed attempt */
+#define  ZMIN_LEN  64             /* Less data is not worth compressing */
 //#define  DEBUG
 
+/* The timers of a socket, bit positions in timers_fired */
+enum
+{
+  TIMER_RTO,                    /* Retransmission, of the SYN and SYNACK too */
+  TIMER_RACK,                   /* End of the RACK reordering window */
+  TIMER_TLP,                    /* Tail loss probe */
+  TIMER_PERSIST,                /* Zero window probe */
+  TIMER_DELACK,                 /* Delayed ACK */
+  TIMER_KEEPALIVE,
+  TIMER_IDLE,
+  TIMER_EXPIRE,                 /* End of the lifetime of a message */
+  TIMER_FEC,                    /* Parity of a partial FEC block */
+  TIMER_COUNT
+};
+
 void print_header(microtcp_header_t header);
+static int sndbuf_flush (microtcp_sock_t *socket);
+static uint64_t now_us (void);
+static int parse_segment (const uint8_t *buf, ssize_t len, microtcp_header_t *header);
+static int parse_segment_at (const uint8_t *buf, const uint8_t *payload, ssize_t len, microtcp_header_t *header);
+static void set_recv_timeout (microtcp_sock_t *socket, uint32_t us);
+static void rtt_sample (microtcp_sock_t *socket, uint32_t rtt);
+static void send_ack (microtcp_sock_t *socket);
+static int keepalive_input (microtcp_sock_t *socket, const microtcp_header_t *packet);
+static void send_keepalive (microtcp_sock_t *socket, uint32_t seq);
+static uint32_t rto_timeout (microtcp_sock_t *socket);
+static timer_wheel_t *thread_timers (void);
+static void timer_expired (timer_entry_t *t);
+static void timer_arm (microtcp_sock_t *socket, int id, uint64_t when);
+static void timer_cancel (microtcp_sock_t *socket, int id);
+static void timers_stop (microtcp_sock_t *socket);
+static ssize_t timed_recvfrom (microtcp_sock_t *socket, void *buf, size_t len, int flags,
+                               struct sockaddr *from, socklen_t *from_len);
+static ssize_t timed_recvmsg (microtcp_sock_t *socket, struct iovec *iov, int iovcnt, int flags,
+                              struct sockaddr *from, socklen_t *from_len);
 microtcp_header_t create_header (uint32_t seq, uint16_t control, uint32_t data_len,  uint32_t ack, uint16_t window) {
   microtcp_header_t msg;
 
@@ -57,6 +107,52 @@ microtcp_header_t reverse(microtcp_header_t msg) {
 
   return msg;
 }
+/* Applies the MSS offered by the peer, peers that send none get MICROTCP_MSS */
+static void set_mss (microtcp_sock_t *socket, uint32_t peer_mss){
+  if(peer_mss<MICROTCP_MSS){
+    peer_mss=MICROTCP_MSS;
+  }
+  socket->max_mss=(peer_mss<MICROTCP_MAX_MSS)?peer_mss:MICROTCP_MAX_MSS;
+  socket->mss=MICROTCP_MSS;
+  socket->probe_high=socket->max_mss+1;
+  if(socket->plpmtu_state!=PLPMTU_DISABLED){
+    socket->plpmtu_state=(socket->max_mss>socket->mss)?PLPMTU_SEARCHING:PLPMTU_SEARCH_COMPLETE;
+  }
+}
+
+/*
+ * Settles the FEC block length offered by the peer in bits 16 to 23 of
+ * its MSS field. FEC is on if both peers want it, with the longer block.
+ */
+static void set_fec (microtcp_sock_t *socket, uint32_t peer_mss){
+  uint32_t peer_k=(peer_mss>>16)&0xff;
+  if(socket->fec_k==0 || peer_k==0){
+    socket->fec_k=0;
+  }else if(peer_k>socket->fec_k){
+    socket->fec_k=(peer_k<MICROTCP_FEC_MAX_BLOCK)?peer_k:MICROTCP_FEC_MAX_BLOCK;
+  }
+}
+
+/* Compression is on if both peers ask for it */
+static void set_compress (microtcp_sock_t *socket, uint32_t peer_mss){
+  socket->compress=socket->compress && (peer_mss&SYN_COMPRESS);
+}
+
+/* Receive buffer space advertised to the peer */
+static uint16_t recv_window (microtcp_sock_t *socket){
+  return MICROTCP_RECVBUF_LEN-socket->buf_fill_level;
+}
+
+/* The window of the handshake holds for every stream until the peer updates it */
+static void set_peer_window (microtcp_sock_t *socket, uint16_t window){
+  socket->init_win_size=window;
+  socket->curr_win_size=window;
+  for(int i=0;i<MICROTCP_MAX_STREAMS;i++){
+    socket->streams[i].peer_win=window;
+    socket->streams[i].ack_win=window;
+  }
+}
+
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol)
 {
@@ -67,13 +163,124 @@ microtcp_socket (int domain, int type, int protocol)
     sock.state=INVALID;
     exit(EXIT_FAILURE);
   }
+  /* The closer of a previous connection may still hold the port, see closer_socket() */
+  int reuse=1;
+  if(setsockopt(sock.sd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(int))==-1){
+    perror("setsockopt");
+  }
   sock.init_win_size=MICROTCP_WIN_SIZE;
   sock.curr_win_size=MICROTCP_WIN_SIZE;
   sock.cwnd=MICROTCP_INIT_CWND;
   sock.ssthresh=MICROTCP_INIT_SSTHRESH;
   sock.buf_fill_level=0;
+  sock.loaned=0;
+  sock.released=0;
   sock.fin=-1;
+  sock.packets_send=0;
+  sock.packets_received=0;
+  sock.packets_lost=0;
+  sock.bytes_send=0;
+  sock.bytes_received=0;
+  sock.bytes_lost=0;
+  sock.retransmits=0;
+  sock.timeouts=0;
+  sock.spurious_timeouts=0;
+  sock.dup_acks=0;
+  histogram_reset(&sock.rtt_hist);
+  sock.trace.events=NULL;
+  sock.trace.mask=0;
+  sock.trace.head=0;
   sock.recvbuf=malloc(MICROTCP_RECVBUF_LEN);
+  sock.streams=calloc(MICROTCP_MAX_STREAMS,sizeof(microtcp_stream_t));
+  for(int i=0;i<MICROTCP_MAX_STREAMS;i++){
+    sock.streams[i].peer_win=MICROTCP_WIN_SIZE;
+    sock.streams[i].ack_win=MICROTCP_WIN_SIZE;
+    sock.streams[i].adv_win=MICROTCP_RECVBUF_LEN;
+  }
+  sock.streams[0].recvbuf=sock.recvbuf;
+  sock.ack_stream=0;
+  sock.recv_stream=0;
+  sock.rcv_ranges=malloc(MICROTCP_RETRANSQ_LEN*sizeof(microtcp_range_t));
+  sock.rcv_range_count=0;
+  sock.retransq.segs=malloc(MICROTCP_RETRANSQ_LEN*sizeof(microtcp_segment_t));
+  sock.retransq.head=0;
+  sock.retransq.count=0;
+  sock.retransq.bytes_in_flight=0;
+  sock.srtt_us=0;
+  sock.rttvar_us=0;
+  sock.min_rtt_us=0;
+  sock.rack_xmit_us=0;
+  sock.last_ack_us=0;
+  sock.tlp_outstanding=0;
+  sock.persist_us=0;
+  sock.in_recovery=0;
+  sock.recovery_seq=0;
+  sock.rcvtimeo_us=0;
+  sock.ts_recent=0;
+  sock.ts_sack=0;
+  sock.rto_undo=0;
+  sock.rto_tsval=0;
+  sock.prior_cwnd=0;
+  sock.prior_ssthresh=0;
+  sock.prior_in_recovery=0;
+  sock.mss=MICROTCP_MSS;
+  sock.max_mss=MICROTCP_MSS;
+  sock.plpmtu_state=PLPMTU_SEARCHING;
+  sock.probe_high=MICROTCP_MSS+1;
+  sock.probe_size=0;
+  sock.probe_count=0;
+  sock.probe_sent_us=0;
+  sock.rto_count=0;
+  sock.sndbuf=malloc(MICROTCP_MAX_MSS);
+  sock.sndbuf_len=0;
+  sock.nodelay=0;
+  sock.cork=0;
+  sock.cork_deadline=0;
+  sock.syn_sent_us=0;
+  sock.syn_rto_us=MICROTCP_SYN_RTO_US;
+  sock.syn_retries=0;
+  sock.syn_data=NULL;
+  sock.syn_data_len=0;
+  sock.syn_cookie=0;
+  sock.fastopen=0;
+  sock.timers=malloc(TIMER_COUNT*sizeof(timer_entry_t));
+  for(int i=0;i<TIMER_COUNT;i++){
+    timer_init(&sock.timers[i],timer_expired,NULL);
+  }
+  sock.timers_fired=0;
+  sock.ack_pending=0;
+  sock.ack_pending_us=0;
+  sock.last_recv_us=0;
+  sock.keepalive_us=0;
+  sock.idle_us=0;
+  sock.keepalive_probes=0;
+  sock.fec_k=0;
+  sock.fec_block=1;
+  sock.fec_count=0;
+  sock.fec_seq=0;
+  sock.fec_offset=0;
+  sock.fec_meta=0;
+  sock.fec_len=0;
+  sock.fec_parity=NULL;
+  sock.fec_first_us=0;
+  sock.fec_blocks=NULL;
+  sock.fec_repairs=0;
+  sock.compress=0;
+  sock.ztx=NULL;
+  sock.ztx_seq=0;
+  sock.ztx_len=0;
+  sock.zrx=NULL;
+  sock.zskip=0;
+  sock.zbackoff=1;
+  sock.zhold=0;
+  sock.bytes_saved=0;
+#ifdef IP_MTU_DISCOVER
+  /* Never fragment, oversized probes have to fail for PLPMTU discovery to work */
+  int pmtudisc=IP_PMTUDISC_PROBE;
+  if(domain==AF_INET && setsockopt(sock.sd,IPPROTO_IP,IP_MTU_DISCOVER,&pmtudisc,sizeof(int))==-1){
+    perror("setsockopt");
+  }
+#endif
 
   return sock;
 
@@ -84,632 +291,3329 @@ int microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address, sock
     perror("binding MicroTCP socket");
     exit(EXIT_FAILURE);
   }
+  return 0;
 }
 
-int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
-  char buf[MICROTCP_RECVBUF_LEN];
-  microtcp_header_t tcp_init;
-  microtcp_header_t rec;
-  microtcp_header_t send;
-  uint32_t checksum;
-  int status;
-  int recvbuf_size=0;
-  srand(time(NULL)+1);
-  socket->seq_number=rand()%10000;
-  tcp_init=create_header(socket->seq_number,SYN,0,0,MICROTCP_WIN_SIZE);
-  tcp_init.checksum=htonl(crc32((uint8_t*)&tcp_init,sizeof(microtcp_header_t)));
+/*
+ * Fast open cookies. A server hands out a cookie bound to the client address,
+ * the client presents it later to have data in its SYN accepted.
+ */
+typedef struct
+{
+  struct in_addr addr;
+  uint32_t cookie;
+} fastopen_entry_t;
+
+static pthread_mutex_t fastopen_lock=PTHREAD_MUTEX_INITIALIZER;
+static fastopen_entry_t fastopen_cache[MICROTCP_FASTOPEN_CACHE_LEN];
+static size_t fastopen_next;
+static uint32_t fastopen_secret;
 
+/* The cookie this host issues to a client, 0 if the address family is not supported */
+static uint32_t fastopen_cookie (const struct sockaddr *address){
+  const struct sockaddr_in *sin=(const struct sockaddr_in*)address;
+  uint32_t cookie;
+  if(address->sa_family!=AF_INET){
+    return 0;
+  }
+  pthread_mutex_lock(&fastopen_lock);
+  while(fastopen_secret==0){
+    fastopen_secret=((uint32_t)rand()<<16)^(uint32_t)rand()^(uint32_t)now_us();
+  }
+  cookie=update_crc32(fastopen_secret,(const uint8_t*)&sin->sin_addr,sizeof(struct in_addr));
+  pthread_mutex_unlock(&fastopen_lock);
+  return (cookie==0)?1:cookie;
+}
+
+/* Looks up the cookie a server gave us before, 0 if there is none */
+static uint32_t fastopen_lookup (const struct sockaddr *address){
+  const struct sockaddr_in *sin=(const struct sockaddr_in*)address;
+  uint32_t cookie=0;
+  size_t i;
+  if(address->sa_family!=AF_INET){
+    return 0;
+  }
+  pthread_mutex_lock(&fastopen_lock);
+  for(i=0;i<MICROTCP_FASTOPEN_CACHE_LEN;i++){
+    if(fastopen_cache[i].cookie!=0 && fastopen_cache[i].addr.s_addr==sin->sin_addr.s_addr){
+      cookie=fastopen_cache[i].cookie;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fastopen_lock);
+  return cookie;
+}
+
+static void fastopen_store (const struct sockaddr *address, uint32_t cookie){
+  const struct sockaddr_in *sin=(const struct sockaddr_in*)address;
+  size_t i;
+  if(address->sa_family!=AF_INET){
+    return;
+  }
+  pthread_mutex_lock(&fastopen_lock);
+  for(i=0;i<MICROTCP_FASTOPEN_CACHE_LEN;i++){
+    if(fastopen_cache[i].cookie!=0 && fastopen_cache[i].addr.s_addr==sin->sin_addr.s_addr){
+      break;
+    }
+  }
+  if(i==MICROTCP_FASTOPEN_CACHE_LEN){
+    /* Replace the oldest entry */
+    i=fastopen_next;
+    fastopen_next=(fastopen_next+1)%MICROTCP_FASTOPEN_CACHE_LEN;
+  }
+  fastopen_cache[i].addr=sin->sin_addr;
+  fastopen_cache[i].cookie=cookie;
+  pthread_mutex_unlock(&fastopen_lock);
+}
+
+/* Bytes of the pending fast open data that ride on the SYN */
+static size_t syn_payload (microtcp_sock_t *socket){
+  if(socket->syn_cookie==0){
+    return 0;
+  }
+  return (socket->syn_data_len<MAX_PAYLOAD_SIZE)?socket->syn_data_len:MAX_PAYLOAD_SIZE;
+}
+
+/* Sends the SYN of a connection attempt, again with the same sequence number on retransmissions */
+static int send_syn (microtcp_sock_t *socket){
+  microtcp_header_t syn;
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t len=syn_payload(socket);
+  uint32_t crc;
+  syn=create_header(socket->seq_number,SYN,len,0,MICROTCP_WIN_SIZE);
+  syn.future_use1=htonl(socket->syn_cookie);
+  syn.future_use2=htonl((socket->compress?SYN_COMPRESS:0)|socket->fec_k<<16|MICROTCP_MAX_MSS);
+  crc=update_crc32(0xffffffff,(const uint8_t*)&syn,sizeof(microtcp_header_t));
+  crc=update_crc32(crc,socket->syn_data,len)^0xffffffff;
+  syn.checksum=htonl(crc);
   #ifdef  DEBUG
-  printf("Sending SYN packet with sequence number: %lu\n",socket->seq_number);
+  printf("Sending SYN packet with sequence number: %lu and %zu data bytes\n",socket->seq_number,len);
   #endif  //DEBUG
-  
-  if(sendto(socket->sd,(void*)&tcp_init,sizeof(microtcp_header_t),0,(struct sockaddr*)address,address_len)==-1){
+  iov[0].iov_base=&syn;
+  iov[0].iov_len=sizeof(microtcp_header_t);
+  iov[1].iov_base=(void*)socket->syn_data;
+  iov[1].iov_len=len;
+  memset(&msg,0,sizeof(struct msghdr));
+  msg.msg_name=socket->address;
+  msg.msg_namelen=socket->address_len;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=2;
+  if(sendmsg(socket->sd,&msg,0)==-1){
     perror("sending SYN packet");
-    exit(EXIT_FAILURE);
+    return -1;
   }
-  memset(buf,0,MICROTCP_RECVBUF_LEN);
-  
-  #ifdef  DEBUG
-  printf("Waiting SYNACK packet with sequence number\n");
-  #endif  //DEBUG
+  socket->packets_send++;
+  socket->syn_sent_us=now_us();
+  return 0;
+}
 
-  status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)address,&address_len);
-  if(status==-1){
-    perror("receiving SYNACK packet");
-    exit(EXIT_FAILURE);
+/* Sends the SYNACK answering the SYN of the peer */
+static int send_synack (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
+  microtcp_header_t synack;
+  synack=create_header(socket->seq_number,SYNACK,0,socket->ack_number,MICROTCP_WIN_SIZE);
+  synack.future_use1=htonl(socket->fastopen?fastopen_cookie(address):0);
+  synack.future_use2=htonl((socket->compress?SYN_COMPRESS:0)|socket->fec_k<<16|socket->max_mss);
+  synack.checksum=htonl(crc32((uint8_t*)&synack,sizeof(microtcp_header_t)));
+  #ifdef  DEBUG
+  printf("Sending SYNACK packet with sequence number: %lu and ack_number: %lu\n",socket->seq_number,socket->ack_number);
+  #endif
+  if(sendto(socket->sd,(void*)&synack,sizeof(microtcp_header_t),0,address,address_len)==-1){
+    perror("sending SYNACK packet");
+    return -1;
   }
-  memcpy(&rec,buf,sizeof(microtcp_header_t));
-  checksum=ntohl(rec.checksum);
-  rec.checksum=0;
-  
-  if(checksum!=crc32((uint8_t*)&rec,sizeof(microtcp_header_t))){
-    perror("checksum error");
-    exit(EXIT_FAILURE);
+  socket->packets_send++;
+  socket->syn_sent_us=now_us();
+  return 0;
+}
+
+/* Handles a datagram received in SYN_SENT, returns 1 once the connection is established */
+static int syn_sent_input (microtcp_sock_t *socket, const uint8_t *buf, ssize_t len){
+  microtcp_header_t rec;
+  size_t sent=syn_payload(socket);
+  if(parse_segment(buf,len,&rec)==-1){
+    return 0;
   }
-  
-  rec=reverse(rec);
+  socket->packets_received++;
   #ifdef DEBUG
   printf("Received SYNACK packet with sequence number: %u and ack_number: %u\n",rec.seq_number,rec.ack_number);
   #endif  //DEBUG
-  if(rec.control==SYNACK&&rec.ack_number==socket->seq_number+1){
-    recvbuf_size=rec.window;
-    socket->ack_number=rec.seq_number+1;
-    socket->seq_number++;
-    send=create_header(socket->seq_number,ACK,0,socket->ack_number,MICROTCP_WIN_SIZE);
-    send.checksum=htonl(crc32((uint8_t*)&send,sizeof(microtcp_header_t)));
-    #ifdef DEBUG
-    printf("Sending ACK packet with sequence number: %lu and ack_number: %lu\n",socket->seq_number,socket->ack_number);
-    #endif  //DEBUG
-    if(sendto(socket->sd,(void*)&send,sizeof(microtcp_header_t),0,(struct sockaddr*)address,address_len)==-1){
-      perror("sending ACK packet");
-      exit(EXIT_FAILURE);
-    }
-  }
-  else{
-    perror("receiving SYNACK packet");
-    exit(EXIT_FAILURE);
+  if(rec.control!=SYNACK){
+    return 0;
   }
+  /* The server acknowledges the data of the SYN only if it accepted our cookie */
+  if(sent>0 && rec.ack_number==socket->seq_number+1+sent){
+    socket->seq_number+=sent;
+    socket->streams[0].send_offset+=sent;
+    socket->syn_data_len=sent;
+  }else if(rec.ack_number==socket->seq_number+1){
+    socket->syn_data_len=0;
+  }else{
+    return 0;
+  }
+  if(rec.future_use1!=0){
+    fastopen_store(socket->address,rec.future_use1);
+  }
+  if(socket->syn_retries==0){
+    /* Karn: only an unambiguous handshake gives the first RTT sample */
+    rtt_sample(socket,now_us()-socket->syn_sent_us);
+  }
+  set_fec(socket,rec.future_use2);
+  set_compress(socket,rec.future_use2);
+  set_mss(socket,rec.future_use2&0xffff);
+  set_peer_window(socket,rec.window);
+  socket->ack_number=rec.seq_number+1;
+  socket->seq_number++;
+  socket->last_recv_us=now_us();
   socket->state=ESTABLISHED;
+  socket->fun=CLIENT;
+  /* The ACK completing the handshake, repeated if the SYNACK comes again */
+  send_ack(socket);
   #ifdef  DEBUG
   printf("Connection Established!\n");
-  
-  #endif  //
+  #endif
+  return 1;
+}
 
-  socket->address=malloc(sizeof(struct sockaddr));
-  *socket->address=*address;
-  socket->address_len=address_len;
-  socket->fun=CLIENT;
-  socket->init_win_size=recvbuf_size;
+int microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len){
+  if(microtcp_connect_many(socket,&address,address_len,1)!=1){
+    return -1;
+  }
   return 0;
+}
 
+ssize_t microtcp_connect_data (microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len, const void *buffer, size_t length){
+  size_t delivered;
+  ssize_t sent;
+  socket->syn_data=(const uint8_t*)buffer;
+  socket->syn_data_len=length;
+  if(microtcp_connect_many(socket,&address,address_len,1)!=1){
+    socket->syn_data=NULL;
+    socket->syn_data_len=0;
+    return -1;
+  }
+  /* What the SYN could not carry goes out as regular data */
+  delivered=socket->syn_data_len;
+  socket->syn_data=NULL;
+  socket->syn_data_len=0;
+  if(delivered==length){
+    return length;
+  }
+  sent=microtcp_send(socket,(const uint8_t*)buffer+delivered,length-delivered,0);
+  if(sent==-1){
+    return -1;
+  }
+  return delivered+sent;
 }
 
-int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address, socklen_t address_len){
+int microtcp_connect_many (microtcp_sock_t *sockets, const struct sockaddr *const *addresses, socklen_t address_len, size_t count){
   char buf[MICROTCP_RECVBUF_LEN];
-  int recvbuf_size=0;
-  microtcp_header_t tcp_init;
-  microtcp_header_t rec;
-  microtcp_header_t rec2;
-  uint32_t checksum;
-  int status;
+  microtcp_sock_t *socket;
+  struct pollfd *fds;
+  struct sockaddr_storage from;
+  socklen_t from_len;
+  size_t pending=0;
+  size_t established=0;
+  size_t i;
+  timer_wheel_t *w=thread_timers();
+  uint64_t now;
+  uint64_t next;
+  int timeout;
+  ssize_t status;
 
-  memset(buf,0,MICROTCP_RECVBUF_LEN);
-  status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)address,&address_len);
-  if(status==-1){
-    perror("receiving SYN packet");
-    exit(EXIT_FAILURE);
+  fds=calloc(count,sizeof(struct pollfd));
+  if(fds==NULL){
+    perror("allocating poll set");
+    return -1;
   }
-  memcpy(&rec,buf,sizeof(microtcp_header_t));
-  checksum=ntohl(rec.checksum);
-  rec.checksum=0;
-  if(checksum != crc32((const uint8_t*)&rec,sizeof(microtcp_header_t))){
-    perror("checksum error");
-    exit(EXIT_FAILURE);
+  srand(time(NULL)+1);
+  for(i=0;i<count;i++){
+    socket=&sockets[i];
+    fds[i].fd=-1;
+    fds[i].events=POLLIN;
+    if(socket->streams==NULL){
+      /* Already shut down, its buffers are gone */
+      errno=EBADF;
+      continue;
+    }
+    if(socket->state!=UNKNOWN){
+      continue;
+    }
+    socket->address=malloc(address_len);
+    memcpy(socket->address,addresses[i],address_len);
+    socket->address_len=address_len;
+    socket->seq_number=rand()%10000;
+    socket->syn_cookie=(socket->syn_data_len>0)?fastopen_lookup(socket->address):0;
+    socket->syn_rto_us=MICROTCP_SYN_RTO_US;
+    socket->syn_retries=0;
+    if(send_syn(socket)==-1){
+      socket->state=CLOSED;
+      continue;
+    }
+    socket->state=SYN_SENT;
+    timer_arm(socket,TIMER_RTO,socket->syn_sent_us+socket->syn_rto_us);
+    fds[i].fd=socket->sd;
+    pending++;
   }
 
-  rec=reverse(rec);
-  if(rec.control!=SYN){
-    perror("receiving SYN packet");
-    exit(EXIT_FAILURE);
+  while(pending>0){
+    /* One wheel holds the SYN timers of all the sockets */
+    now=now_us();
+    next=timer_wheel_next(w);
+    timeout=(next==UINT64_MAX)?-1:(next>now)?(int)((next-now+999)/1000):0;
+    if(poll(fds,count,timeout)==-1){
+      if(errno==EINTR){
+        continue;
+      }
+      perror("waiting for SYNACK packets");
+      break;
+    }
+    for(i=0;i<count;i++){
+      sockets[i].timers_fired=0;
+    }
+    timer_wheel_advance(w,now_us());
+    for(i=0;i<count;i++){
+      if(fds[i].fd==-1){
+        continue;
+      }
+      socket=&sockets[i];
+      if(fds[i].revents&POLLIN){
+        for(;;){
+          from_len=sizeof(from);
+          status=recvfrom(socket->sd,buf,sizeof(buf),MSG_DONTWAIT,(struct sockaddr*)&from,&from_len);
+          if(status==-1){
+            break;
+          }
+          if(syn_sent_input(socket,(const uint8_t*)buf,status)){
+            timer_cancel(socket,TIMER_RTO);
+            fds[i].fd=-1;
+            pending--;
+            established++;
+            break;
+          }
+        }
+        if(fds[i].fd==-1){
+          continue;
+        }
+      }
+      /* Retransmit the SYNs that timed out, give up on those out of retries */
+      if(socket->timers_fired&(1U<<TIMER_RTO)){
+        if(socket->syn_retries==MICROTCP_SYN_RETRIES || send_syn(socket)==-1){
+          #ifdef  DEBUG
+          printf("Connection attempt timed out\n");
+          #endif
+          socket->state=CLOSED;
+          fds[i].fd=-1;
+          pending--;
+          continue;
+        }
+        socket->syn_retries++;
+        socket->syn_rto_us*=2;
+        timer_arm(socket,TIMER_RTO,socket->syn_sent_us+socket->syn_rto_us);
+      }
+    }
   }
-  #ifdef  DEBUG
-  printf("Received SYN packet with sequence number: %u\n",rec.seq_number);
-  #endif  //DEG
-  socket->seq_number=rand()%10000;
-  srand(time(NULL));
-  socket->ack_number=rec.seq_number+1;
-
-  tcp_init=create_header(socket->seq_number,SYNACK,0,socket->ack_number,MICROTCP_WIN_SIZE);
-  tcp_init.checksum=htonl(crc32((uint8_t*)&tcp_init,sizeof(microtcp_header_t)));
-  #ifdef  DEBUG
-  printf("Sending SYNACK packet with sequence number: %lu and ack_number: %lu\n",socket->seq_number,socket->ack_number);
-  #endif
-  if(sendto(socket->sd,(void*)&tcp_init,sizeof(microtcp_header_t),0,(struct sockaddr*)address,address_len)==-1){
-    perror("sending SYNACK packet");
-    exit(EXIT_FAILURE);
+  for(i=0;i<count;i++){
+    timer_cancel(&sockets[i],TIMER_RTO);
   }
-
-  memset(buf,0,MICROTCP_RECVBUF_LEN);
-  #ifdef  DEBUG
-  printf("Waiting ACK packet with sequence number: %lu and ack_number: %lu\n",socket->seq_number,socket->ack_number);
-  #endif
-  status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)address,&address_len);
-  if(status==-1){
-    perror("receiving ACK packet");
-    exit(EXIT_FAILURE);
+  free(fds);
+  if(established<count){
+    errno=ETIMEDOUT;
   }
-  memcpy(&rec2,buf,sizeof(microtcp_header_t));
-  checksum=ntohl(rec2.checksum);
-  rec2.checksum=0;
-  if(checksum!=crc32((uint8_t*)&rec2,sizeof(microtcp_header_t))){
-    perror("checksum error");
-    exit(EXIT_FAILURE);
+  return established;
+}
+
+int microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address, socklen_t address_len){
+  char buf[MICROTCP_RECVBUF_LEN];
+  microtcp_header_t rec;
+  struct sockaddr_storage from;
+  socklen_t from_len;
+  socklen_t peer_len;
+  uint32_t syn_seq;
+  int status;
+
+  if(socket->streams==NULL){
+    errno=EBADF;
+    return -1;
   }
-  socket->seq_number++;
-  rec2=reverse(rec2);
-  if(rec2.control !=ACK || rec2.seq_number != socket->ack_number || rec2.ack_number != socket->seq_number ){
-    socket->seq_number--;
-    perror("receiving ACK packet");
-    exit(EXIT_FAILURE);
+  for(;;){
+    socket->state=LISTEN;
+    /* A failed handshake leaves its timeout on the socket, listening blocks */
+    set_recv_timeout(socket,0);
+    peer_len=address_len;
+    status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,address,&peer_len);
+    if(status==-1){
+      if(errno==EAGAIN||errno==EWOULDBLOCK){
+        continue;
+      }
+      if(errno!=EINTR){
+        perror("receiving SYN packet");
+      }
+      return -1;
+    }
+    if(parse_segment((const uint8_t*)buf,status,&rec)==-1 || rec.control!=SYN){
+      continue;
+    }
+    socket->packets_received++;
+    #ifdef  DEBUG
+    printf("Received SYN packet with sequence number: %u\n",rec.seq_number);
+    #endif  //DEG
+    srand(time(NULL));
+    socket->seq_number=rand()%10000;
+    syn_seq=rec.seq_number;
+    socket->ack_number=rec.seq_number+1;
+    socket->buf_fill_level=0;
+    socket->streams[0].recv_offset=0;
+    if(rec.data_len>0 && socket->fastopen && rec.future_use1==fastopen_cookie(address)){
+      /* Valid cookie, the data of the SYN is delivered and acknowledged by the SYNACK */
+      memcpy(socket->recvbuf,buf+sizeof(microtcp_header_t),rec.data_len);
+      socket->buf_fill_level=rec.data_len;
+      socket->streams[0].recv_offset=rec.data_len;
+      socket->bytes_received+=rec.data_len;
+      socket->ack_number+=rec.data_len;
+    }
+    set_fec(socket,rec.future_use2);
+    set_compress(socket,rec.future_use2);
+    set_mss(socket,rec.future_use2&0xffff);
+    socket->syn_rto_us=MICROTCP_SYN_RTO_US;
+    socket->syn_retries=0;
+    if(send_synack(socket,address,peer_len)==-1){
+      return -1;
+    }
+    socket->state=SYN_RECEIVED;
+
+    /* Wait for the ACK, resending the SYNACK when it is late or the SYN comes again */
+    while(socket->state==SYN_RECEIVED){
+      timer_arm(socket,TIMER_RTO,socket->syn_sent_us+socket->syn_rto_us);
+      from_len=sizeof(from);
+      status=timed_recvfrom(socket,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)&from,&from_len);
+      if(status==-1){
+        if(errno!=EAGAIN&&errno!=EWOULDBLOCK){
+          if(errno!=EINTR){
+            perror("receiving ACK packet");
+          }
+          timers_stop(socket);
+          return -1;
+        }
+        if(socket->timers_fired&(1U<<TIMER_RTO)){
+          if(socket->syn_retries==MICROTCP_SYN_RETRIES){
+            #ifdef  DEBUG
+            printf("Handshake timed out, listening again\n");
+            #endif
+            break;
+          }
+          socket->syn_retries++;
+          socket->syn_rto_us*=2;
+          if(send_synack(socket,address,peer_len)==-1){
+            timers_stop(socket);
+            return -1;
+          }
+        }
+        continue;
+      }
+      if(from_len!=peer_len || memcmp(&from,address,peer_len)!=0
+         || parse_segment((const uint8_t*)buf,status,&rec)==-1){
+        continue;
+      }
+      socket->packets_received++;
+      if(rec.control==SYN){
+        if(rec.seq_number==syn_seq){
+          socket->syn_retries++;
+          if(send_synack(socket,address,peer_len)==-1){
+            timers_stop(socket);
+            return -1;
+          }
+        }
+        continue;
+      }
+      /* Any ACK of our SYN completes the handshake, data riding on it is sent again by the peer */
+      if((rec.control&ACK) && rec.ack_number==socket->seq_number+1){
+        if(socket->syn_retries==0){
+          rtt_sample(socket,now_us()-socket->syn_sent_us);
+        }
+        socket->seq_number++;
+        set_peer_window(socket,rec.window);
+        socket->last_recv_us=now_us();
+        socket->state=ESTABLISHED;
+      }
+    }
+    timers_stop(socket);
+    if(socket->state==ESTABLISHED){
+      break;
+    }
   }
-  recvbuf_size=rec2.window;
-  socket->state=ESTABLISHED;
   #ifdef  DEBUG
   printf("Connection Established!\n");
   #endif  //
-  socket->address=malloc(sizeof(struct sockaddr));
-  *socket->address=*address;
-  socket->address_len=address_len;
+  socket->address=malloc(peer_len);
+  memcpy(socket->address,address,peer_len);
+  socket->address_len=peer_len;
   socket->fun=SERVER;
-  socket->init_win_size=recvbuf_size;
   return 0;
 }
 
-int microtcp_shutdown (microtcp_sock_t *socket, int how){
+/*
+ * A connection being closed. microtcp_shutdown() hands it over to the
+ * closer thread, which owns a UDP socket of its own and keeps only what
+ * the FIN exchange needs, so the caller may release everything else.
+ */
+typedef struct closer
+{
+  int sd;                       /**< Socket on the local address, connected to the peer */
+  struct sockaddr_storage address;
+  socklen_t address_len;
+  mircotcp_state_t state;       /**< CLOSING_BY_HOST, CLOSING_BY_PEER, TIME_WAIT or CLOSED when done */
+  uint32_t fin_seq;             /**< Sequence number of our FIN */
+  uint32_t ack_number;          /**< Acknowledges the FIN of the peer */
+  int fin_acked;                /**< The peer has our FIN */
+  int settled;                  /**< Nothing left to answer, the process may exit */
+  uint32_t rto_us;
+  int retries;
+  uint64_t deadline;            /**< Next FIN retransmission or end of the current state */
+  timer_entry_t timer;          /**< Fires at deadline */
+  struct closer *next;
+} closer_t;
+
+static pthread_mutex_t closer_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closer_cond=PTHREAD_COND_INITIALIZER;
+static pthread_once_t closer_once=PTHREAD_ONCE_INIT;
+static closer_t *closers;
+static timer_wheel_t closer_timers;
+static size_t closers_unsettled;
+static int closer_exiting;
+static int closer_pipe[2]={-1,-1};
+
+static void closer_send (closer_t *c, uint32_t seq, uint16_t control, uint32_t ack){
   microtcp_header_t packet;
-  char buf[MICROTCP_RECVBUF_LEN];
-  int status;
-  uint32_t checksum;
-  if(socket->fun==SERVER){
-    #ifdef  DEBUG
-    printf("State has changed to CLOSING_BY_PEER\n");
-    #endif
-    /* Sending ACK*/
-    packet=create_header(socket->seq_number,ACK,0,socket->ack_number,0);
-    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-    #ifdef  DEBUG
-    printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-    #endif
-    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-      perror("sending SYN packet");
-      exit(EXIT_FAILURE);
-    }
-    /*Sending FINACK*/
-    socket->seq_number++;
-    packet=create_header(socket->seq_number,FINACK,0,0,0);
-    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-    #ifdef  DEBUG
-    printf("Sending FINACK packet with sequence number: %lu\n",socket->seq_number);
-    #endif
-    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-      perror("sending SYN packet");
-      exit(EXIT_FAILURE);
-    }
-    /*Receiving ACK packet*/
-    memset(buf,0,MICROTCP_RECVBUF_LEN);
-    status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)socket->address,&socket->address_len);
-    if(status==-1){
-      perror("receiving ACK packet");
-      exit(EXIT_FAILURE);
-    }
-    memcpy(&packet,buf,sizeof(microtcp_header_t));
-    checksum=ntohl(packet.checksum);
-    packet.checksum=0;
-    if(checksum != crc32((const uint8_t*)&packet,sizeof(microtcp_header_t))){
-      perror("checksum error");
-      exit(EXIT_FAILURE);
-    }
-    packet=reverse(packet);
-    if(packet.control!=ACK){
-      perror("receiving ACK packet");
+  packet=create_header(seq,control,0,ack,0);
+  packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
+  #ifdef  DEBUG
+  printf("Sending %s packet with sequence number: %u\n",(control==FINACK)?"FINACK":"ACK",seq);
+  #endif
+  if(sendto(c->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)&c->address,c->address_len)==-1){
+    perror("sending FIN exchange packet");
+  }
+}
+
+static void closer_arm (closer_t *c, uint64_t deadline){
+  c->deadline=deadline;
+  timer_wheel_add(&closer_timers,&c->timer,deadline);
+}
+
+static void closer_settle (closer_t *c){
+  if(!c->settled){
+    c->settled=1;
+    closers_unsettled--;
+    pthread_cond_broadcast(&closer_cond);
+  }
+}
+
+static void closer_input (closer_t *c, const microtcp_header_t *rec, uint64_t now){
+  if(rec->control==FINACK){
+    /* Our ACK of the FIN of the peer was lost, or the peer closes too */
+    if(c->state==CLOSING_BY_HOST){
+      c->ack_number=rec->seq_number+1;
+      c->state=TIME_WAIT;
+      closer_arm(c,now+(closer_exiting?2*c->rto_us:MICROTCP_TIME_WAIT_US));
+      /* The peer sends its FIN only after it got ours */
+      c->fin_acked=1;
+      #ifdef  DEBUG
+      printf("State has changed to TIME_WAIT\n");
+      #endif
     }
-  
-    if(packet.seq_number!=socket->ack_number){
-      perror("receiving seq number");
-      exit(EXIT_FAILURE);
+    if(c->state==TIME_WAIT){
+      closer_send(c,c->fin_seq+1,ACK,c->ack_number);
+    }else if(c->state==CLOSING_BY_PEER){
+      closer_send(c,c->fin_seq-1,ACK,c->ack_number);
     }
-    if(packet.ack_number!= ++socket->seq_number){
-      perror("receiving ack number");
-      exit(EXIT_FAILURE);
+    return;
+  }
+  if((rec->control&ACK) && rec->ack_number==c->fin_seq+1 && !c->fin_acked){
+    c->fin_acked=1;
+    if(c->state==CLOSING_BY_PEER){
+      c->state=CLOSED;
+      closer_settle(c);
+    }else if(c->state==CLOSING_BY_HOST){
+      /* Wait for the FIN of the peer, but not forever and only briefly at exit */
+      closer_arm(c,now+(closer_exiting?MICROTCP_TIME_WAIT_US:MICROTCP_FIN_WAIT_US));
     }
-    #ifdef  DEBUG
-    printf("Received ACK packet with sequence number: %u and ack_number: %u\n",packet.seq_number,packet.ack_number);
-    #endif
-    /*Connection Closed*/
-    socket->state=CLOSED;
+  }
+}
+
+static void closer_timeout (closer_t *c, uint64_t now){
+  if(c->state==TIME_WAIT || c->fin_acked || c->retries==MICROTCP_FIN_RETRIES){
     #ifdef  DEBUG
     printf("State has changed to CLOSED\n");
-    printf("TCP Connection Closed\n");
-    #endif
-  }else if(socket->fun==CLIENT){
-    /* Sending 1st packet -> FINACK*/
-    packet=create_header(socket->seq_number,FINACK,0,0,0);
-    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-    #ifdef  DEBUG
-    printf("Sending FINACK packet with sequence number: %lu\n",socket->seq_number);
     #endif
-    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-      perror("sending SYN packet");
-      exit(EXIT_FAILURE);
-    }
+    c->state=CLOSED;
+    closer_settle(c);
+    return;
+  }
+  c->retries++;
+  c->rto_us*=2;
+  closer_arm(c,now+c->rto_us);
+  closer_send(c,c->fin_seq,FINACK,0);
+}
 
-    /*Receicing ACK packet*/
-    memset(buf,0,MICROTCP_RECVBUF_LEN);
-    status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)socket->address,&socket->address_len);
-    if(status==-1){
-      perror("receiving ACK packet");
-      exit(EXIT_FAILURE);
-    }
-    memcpy(&packet,buf,sizeof(microtcp_header_t));
-    checksum=ntohl(packet.checksum);
-    packet.checksum=0;
-    if(checksum != crc32((const uint8_t*)&packet,sizeof(microtcp_header_t))){
-      perror("checksum error 5");
-      exit(EXIT_FAILURE);
-    }
+static void closer_expired (timer_entry_t *t){
+  closer_timeout(t->arg,now_us());
+}
+
+/*
+ * Runs the FIN exchanges and TIME_WAITs of all closing connections, their
+ * timers share one wheel so a wakeup costs nothing per idle connection.
+ */
+static void *closer_main (void *arg){
+  char buf[MICROTCP_RECVBUF_LEN];
+  struct pollfd *fds=NULL;
+  closer_t **polled=NULL;
+  size_t cap=0;
+  size_t n;
+  size_t i;
+  closer_t **link;
+  closer_t *c;
+  microtcp_header_t rec;
+  uint64_t now;
+  uint64_t deadline;
+  ssize_t status;
 
-    packet=reverse(packet);
-    if(packet.control!=ACK){
-      perror("receiving ACK packet.");
-      exit(EXIT_FAILURE);
+  (void)arg;
+  for(;;){
+    pthread_mutex_lock(&closer_lock);
+    now=now_us();
+    timer_wheel_advance(&closer_timers,now);
+    deadline=timer_wheel_next(&closer_timers);
+    n=0;
+    link=&closers;
+    while((c=*link)!=NULL){
+      if(c->state==CLOSED){
+        *link=c->next;
+        timer_wheel_del(&closer_timers,&c->timer);
+        close(c->sd);
+        free(c);
+        continue;
+      }
+      n++;
+      link=&c->next;
     }
-    if(packet.ack_number!=socket->seq_number+1){
-      perror("receiving ack number.");
-      exit(EXIT_FAILURE);
+    if(n+1>cap){
+      cap=2*(n+1);
+      fds=realloc(fds,cap*sizeof(struct pollfd));
+      polled=realloc(polled,cap*sizeof(closer_t*));
     }
-    #ifdef  DEBUG
-    printf("Received ACK packet ack_number: %u\n",packet.ack_number);
-    #endif
-    socket->state=CLOSING_BY_HOST;
-    #ifdef  DEBUG
-    printf("State has changed to CLOSING_BY_HOST\n");
-    #endif
+    fds[0].fd=closer_pipe[0];
+    fds[0].events=POLLIN;
+    for(i=1,c=closers;c!=NULL;c=c->next,i++){
+      fds[i].fd=c->sd;
+      fds[i].events=POLLIN;
+      polled[i]=c;
+    }
+    pthread_mutex_unlock(&closer_lock);
 
-    /*Receiving FINACK*/
-    memset(buf,0,MICROTCP_RECVBUF_LEN);
-    status=recvfrom(socket->sd,(void*)buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)socket->address,&socket->address_len);
-    if(status==-1){
-      perror("receiving FINACK packet");
-      exit(EXIT_FAILURE);
+    /* Only this thread unlinks closers, so the polled ones stay valid */
+    if(poll(fds,n+1,(deadline==UINT64_MAX)?-1:(deadline>now)?(int)((deadline-now+999)/1000):0)==-1){
+      if(errno!=EINTR){
+        perror("waiting for FIN exchange packets");
+      }
+      continue;
     }
-    memcpy(&packet,buf,sizeof(microtcp_header_t));
-    checksum=ntohl(packet.checksum);
-    packet.checksum=0;
-    if(checksum != crc32((const uint8_t*)&packet,sizeof(microtcp_header_t))){
-      perror("checksum error 6");
-      exit(EXIT_FAILURE);
+    if(fds[0].revents&POLLIN){
+      while(read(closer_pipe[0],buf,sizeof(buf))>0);
     }
-
-    packet=reverse(packet);
-    if(packet.control!=FINACK){
-      perror("receiving SYN packet");
+    pthread_mutex_lock(&closer_lock);
+    for(i=1;i<=n;i++){
+      if(!(fds[i].revents&(POLLIN|POLLERR))){
+        continue;
+      }
+      /* An ICMP error is reported by the first recv(), which clears it */
+      c=polled[i];
+      while((status=recv(c->sd,buf,sizeof(buf),MSG_DONTWAIT))>=0){
+        if(parse_segment((const uint8_t*)buf,status,&rec)==0){
+          closer_input(c,&rec,now_us());
+        }
+      }
     }
-    #ifdef  DEBUG
-    printf("Received FINACK packet with sequence number: %u\n",packet.seq_number);
-    #endif
-    /*Sending ACK packet*/
-    socket->ack_number=packet.seq_number+1;
-    socket->seq_number++;
+    pthread_mutex_unlock(&closer_lock);
+  }
+  return NULL;
+}
 
-    packet=create_header(socket->seq_number,ACK,0,socket->ack_number,0);
-    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-    #ifdef  DEBUG
-    printf("Sending ACK packet with sequence number: %lu\n",socket->seq_number);
-    #endif
-    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-      perror("sending SYN packet");
-      exit(EXIT_FAILURE);
+/*
+ * At exit, wait for the FIN exchanges still running, or the peers never
+ * learn that the connections ended. A peer that acknowledged our FIN but
+ * keeps its side open is given MICROTCP_TIME_WAIT_US instead of the full
+ * MICROTCP_FIN_WAIT_US, and TIME_WAIT lasts only two RTOs, enough to
+ * answer one retransmitted FIN.
+ */
+static void closer_drain (void){
+  uint64_t now;
+  closer_t *c;
+  pthread_mutex_lock(&closer_lock);
+  closer_exiting=1;
+  now=now_us();
+  for(c=closers;c!=NULL;c=c->next){
+    if(c->state==CLOSING_BY_HOST && c->fin_acked && c->deadline>now+MICROTCP_TIME_WAIT_US){
+      closer_arm(c,now+MICROTCP_TIME_WAIT_US);
+    }else if(c->state==TIME_WAIT && c->deadline>now+2*c->rto_us){
+      closer_arm(c,now+2*c->rto_us);
     }
-    /*Connection Closed*/
-    socket->state=CLOSED;
-    #ifdef  DEBUG
-    printf("State has changed to CLOSED\n");
-    #endif
-  }else{
-    perror("Invalid how value");
   }
-  free(socket->address);
-  shutdown(socket->sd,how);
-  return 0;
+  if(write(closer_pipe[1],"",1)==-1){
+    perror("waking the closer thread");
+  }
+  while(closers_unsettled>0){
+    pthread_cond_wait(&closer_cond,&closer_lock);
+  }
+  pthread_mutex_unlock(&closer_lock);
 }
-int min(int,int,int);
-ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
-    int i;
-    size_t data_sent=0;
-    int bytes_to_send;
-    int chunks;
-    int remaining = length;
-    microtcp_header_t header;
-    void *send_buf;
+
+static void closer_start (void){
+  pthread_t thread;
+  if(pipe(closer_pipe)==-1){
+    perror("creating closer pipe");
+    return;
+  }
+  fcntl(closer_pipe[0],F_SETFL,O_NONBLOCK);
+  timer_wheel_init(&closer_timers,MICROTCP_TIMER_TICK_US,now_us());
+  if(pthread_create(&thread,NULL,closer_main,NULL)!=0){
+    perror("starting closer thread");
+    close(closer_pipe[0]);
+    close(closer_pipe[1]);
+    closer_pipe[0]=-1;
+    return;
+  }
+  pthread_detach(thread);
+  atexit(closer_drain);
+}
+
+/*
+ * A socket of its own for the closer, on the local address of the
+ * connection and connected to the peer, so it only takes the datagrams of
+ * the peer and the application keeps the others. Both sockets need
+ * SO_REUSEADDR, set by microtcp_socket(); failing that, the closer falls
+ * back to a duplicate of the application socket.
+ */
+static int closer_socket (int sd, const struct sockaddr *peer, socklen_t peer_len){
+  struct sockaddr_storage local;
+  socklen_t local_len=sizeof(local);
+  int reuse=1;
+  int csd;
+  if(getsockname(sd,(struct sockaddr*)&local,&local_len)==-1
+     || (csd=socket(local.ss_family,SOCK_DGRAM,0))==-1){
+    return dup(sd);
+  }
+  if(setsockopt(csd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(int))==-1
+     || bind(csd,(struct sockaddr*)&local,local_len)==-1
+     || connect(csd,peer,peer_len)==-1){
+    close(csd);
+    return dup(sd);
+  }
+  return csd;
+}
+
+/* Sends and receives need a connection, not yet up or closed by microtcp_shutdown() */
+static int check_connected (const microtcp_sock_t *socket){
+  if(socket->streams==NULL || (socket->state!=ESTABLISHED && socket->state!=CLOSING_BY_PEER)){
+    errno=ENOTCONN;
+    return -1;
+  }
+  return 0;
+}
+
+/* Frees what only the data path needs, the statistics stay readable */
+static void release_buffers (microtcp_sock_t *socket){
+  microtcp_stream_t *st;
+  for(int i=0;i<MICROTCP_MAX_STREAMS && socket->streams!=NULL;i++){
+    st=&socket->streams[i];
+    if(i>0){
+      free(st->recvbuf);
+    }
+    free(st->ranges);
+    free(st->records);
+  }
+  free(socket->streams);
+  socket->streams=NULL;
+  free(socket->rcv_ranges);
+  socket->rcv_ranges=NULL;
+  socket->rcv_range_count=0;
+  free(socket->recvbuf);
+  socket->recvbuf=NULL;
+  socket->buf_fill_level=0;
+  socket->loaned=0;
+  socket->released=0;
+  free(socket->sndbuf);
+  socket->sndbuf=NULL;
+  socket->sndbuf_len=0;
+  free(socket->retransq.segs);
+  socket->retransq.segs=NULL;
+  free(socket->fec_parity);
+  socket->fec_parity=NULL;
+  for(int i=0;i<MICROTCP_FEC_BLOCKS && socket->fec_blocks!=NULL;i++){
+    free(socket->fec_blocks[i].acc);
+  }
+  free(socket->fec_blocks);
+  socket->fec_blocks=NULL;
+  free(socket->ztx);
+  socket->ztx=NULL;
+  socket->ztx_len=0;
+  free(socket->zrx);
+  socket->zrx=NULL;
+  socket->retransq.count=0;
+  free(socket->address);
+  socket->address=NULL;
+  socket->cork_deadline=0;
+  free(socket->timers);
+  socket->timers=NULL;
+}
+
+int microtcp_shutdown (microtcp_sock_t *socket, int how){
+  closer_t *c;
+  (void)how;
+  if(socket->state!=ESTABLISHED && socket->state!=CLOSING_BY_PEER){
+    release_buffers(socket);
+    errno=ENOTCONN;
+    return -1;
+  }
+  if(sndbuf_flush(socket)==-1){
+    return -1;
+  }
+  pthread_once(&closer_once,closer_start);
+  c=malloc(sizeof(closer_t));
+  if(c==NULL || closer_pipe[0]==-1 || (c->sd=closer_socket(socket->sd,socket->address,socket->address_len))==-1){
+    perror("handing over the connection");
+    free(c);
+    return -1;
+  }
+  memcpy(&c->address,socket->address,socket->address_len);
+  c->address_len=socket->address_len;
+  c->ack_number=socket->ack_number;
+  if(socket->state==CLOSING_BY_PEER){
+    /* The peer's FIN came first, ours follows the ACK and takes one more sequence number */
+    c->state=CLOSING_BY_PEER;
+    c->fin_seq=socket->seq_number+1;
+  }else{
+    c->state=CLOSING_BY_HOST;
+    c->fin_seq=socket->seq_number;
+  }
+  c->fin_acked=0;
+  c->settled=0;
+  c->retries=0;
+  c->rto_us=rto_timeout(socket);
+  timer_init(&c->timer,closer_expired,c);
+  #ifdef  DEBUG
+  printf("State has changed to %s\n",(c->state==CLOSING_BY_PEER)?"CLOSING_BY_PEER":"CLOSING_BY_HOST");
+  #endif
+  /* The first FIN leaves right away, the closer thread takes care of the rest */
+  closer_send(c,c->fin_seq,FINACK,0);
+  socket->packets_send++;
+
+  pthread_mutex_lock(&closer_lock);
+  closer_arm(c,now_us()+c->rto_us);
+  c->next=closers;
+  closers=c;
+  closers_unsettled++;
+  pthread_mutex_unlock(&closer_lock);
+  if(write(closer_pipe[1],"",1)==-1){
+    perror("waking the closer thread");
+  }
+  socket->state=CLOSED;
+  release_buffers(socket);
+  return 0;
+}
+size_t min(size_t,size_t,size_t);
+
+static uint64_t now_us (void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/* Wrap-around safe comparison of 32-bit sequence numbers */
+static int seq_before (uint32_t a, uint32_t b){
+  return (int32_t)(a-b)<0;
+}
+
+static microtcp_segment_t *retransq_at (microtcp_retransq_t *q, size_t i){
+  return &q->segs[(q->head+i)%MICROTCP_RETRANSQ_LEN];
+}
+
+static microtcp_segment_t *retransq_push (microtcp_retransq_t *q, uint32_t seq, const uint8_t *data, uint32_t data_len,
+                                          uint32_t stream, uint32_t stream_offset){
+  microtcp_segment_t *seg;
+  if(q->count==MICROTCP_RETRANSQ_LEN){
+    return NULL;
+  }
+  seg=retransq_at(q,q->count++);
+  seg->seq_start=seq;
+  seg->seq_end=seq+data_len;
+  seg->data=data;
+  seg->data_len=data_len;
+  seg->stream=stream;
+  seg->stream_offset=stream_offset;
+  seg->flags=0;
+  seg->fec_block=0;
+  seg->sent_us=0;
+  seg->retransmits=0;
+  seg->lost=0;
+  q->bytes_in_flight+=data_len;
+  return seg;
+}
+
+/* Appends an event to the trace ring, a single branch when tracing is off */
+static void trace_event (microtcp_sock_t *socket, uint32_t type, uint32_t seq, uint32_t len){
+  microtcp_trace_t *t=&socket->trace;
+  microtcp_trace_event_t *ev;
+  if(t->events==NULL){
+    return;
+  }
+  ev=&t->events[t->head&t->mask];
+  ev->time_us=now_us();
+  ev->type=type;
+  ev->seq=seq;
+  ev->len=len;
+  ev->cwnd=socket->cwnd;
+  ev->ssthresh=socket->ssthresh;
+  ev->peer_win=socket->curr_win_size;
+  ev->srtt_us=socket->srtt_us;
+  ev->in_flight=socket->retransq.bytes_in_flight;
+  /* Publish the event only after it has been written */
+  __atomic_store_n(&t->head,t->head+1,__ATOMIC_RELEASE);
+}
+
+/* Drops every segment covered by the cumulative ACK and returns the bytes freed */
+static size_t retransq_ack (microtcp_retransq_t *q, uint32_t ack){
+  microtcp_segment_t *seg;
+  size_t acked=0;
+  while(q->count>0){
+    seg=retransq_at(q,0);
+    if(seq_before(ack,seg->seq_end)){
+      break;
+    }
+    if(!seg->lost){
+      q->bytes_in_flight-=seg->data_len;
+    }
+    acked+=seg->data_len;
+    q->head=(q->head+1)%MICROTCP_RETRANSQ_LEN;
+    q->count--;
+  }
+  return acked;
+}
+
+/* Marks queued segments from index first on for retransmission */
+static void retransq_mark_lost (microtcp_sock_t *socket, size_t first){
+  microtcp_retransq_t *q=&socket->retransq;
+  microtcp_segment_t *seg;
+  size_t i;
+  for(i=first;i<q->count;i++){
+    seg=retransq_at(q,i);
+    if(!seg->lost){
+      seg->lost=1;
+      q->bytes_in_flight-=seg->data_len;
+      socket->packets_lost++;
+      socket->bytes_lost+=seg->data_len;
+    }
+  }
+}
+
+/*
+ * The payload of a segment as it goes on the wire. Only the last compressed
+ * payload is kept, a retransmission compresses its segment again, the
+ * codec giving back the same bytes for the same input.
+ */
+static const uint8_t *segment_payload (microtcp_sock_t *socket, const microtcp_segment_t *seg, size_t *len){
+  size_t consumed=seg->data_len;
+  if(!(seg->flags&COMPRESSED)){
+    *len=seg->data_len;
+    return seg->data;
+  }
+  if(socket->ztx_len==0 || socket->ztx_seq!=seg->seq_end){
+    socket->ztx_len=lz_compress(seg->data,&consumed,socket->ztx,MICROTCP_MAX_MSS);
+    socket->ztx_seq=seg->seq_end;
+  }
+  *len=socket->ztx_len;
+  return socket->ztx;
+}
+
+/* Builds the header of a data segment, its checksum covering the header and the payload */
+static microtcp_header_t segment_header (microtcp_sock_t *socket, const microtcp_segment_t *seg,
+                                         const uint8_t *payload, size_t len){
+  microtcp_header_t header;
+  uint32_t crc;
+
+  header=create_header(seg->seq_end,ACK|seg->flags,len,socket->ack_number,recv_window(socket));
+  header.future_use0=htonl((uint32_t)now_us());
+  header.future_use1=htonl(seg->stream_offset);
+  header.future_use2=htonl((uint32_t)seg->fec_block<<16|seg->stream);
+  crc=update_crc32(0xffffffff,(const uint8_t*)&header,sizeof(microtcp_header_t));
+  crc=update_crc32(crc,payload,len)^0xffffffff;
+  header.checksum=htonl(crc);
+  return header;
+}
+
+/*
+ * Checks the length and checksum of a received datagram without modifying it.
+ * On success the header is stored in host byte order.
+ */
+static int parse_segment (const uint8_t *buf, ssize_t len, microtcp_header_t *header){
+  return parse_segment_at(buf,buf+sizeof(microtcp_header_t),len,header);
+}
+
+/* As parse_segment(), for a datagram received with its payload apart from the header */
+static int parse_segment_at (const uint8_t *buf, const uint8_t *payload, ssize_t len, microtcp_header_t *header){
+  microtcp_header_t net;
+  uint32_t crc;
+
+  if(len<(ssize_t)sizeof(microtcp_header_t)){
+    return -1;
+  }
+  memcpy(&net,buf,sizeof(microtcp_header_t));
+  *header=reverse(net);
+  if(header->data_len>len-sizeof(microtcp_header_t)){
+    return -1;
+  }
+  net.checksum=0;
+  crc=update_crc32(0xffffffff,(const uint8_t*)&net,sizeof(microtcp_header_t));
+  crc=update_crc32(crc,payload,header->data_len)^0xffffffff;
+  return (crc==header->checksum)?0:-1;
+}
+
+/* Builds the header in front of the referenced payload and sends both without copying */
+static int transmit_segment (microtcp_sock_t *socket, microtcp_segment_t *seg){
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  const uint8_t *payload;
+  size_t len;
+
+  payload=segment_payload(socket,seg,&len);
+  header=segment_header(socket,seg,payload,len);
+  iov[0].iov_base=&header;
+  iov[0].iov_len=sizeof(microtcp_header_t);
+  iov[1].iov_base=(void*)payload;
+  iov[1].iov_len=len;
+  memset(&msg,0,sizeof(struct msghdr));
+  msg.msg_name=socket->address;
+  msg.msg_namelen=socket->address_len;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=2;
+  #ifdef  DEBUG
+  printf("Sending packet with sequence number: %u, retransmits: %u\n",seg->seq_end,seg->retransmits);
+  #endif
+  if(sendmsg(socket->sd,&msg,0)==-1){
+    perror("sending packet");
+    return -1;
+  }
+  socket->packets_send++;
+  socket->bytes_send+=len;
+  socket->bytes_saved+=seg->data_len-len;
+  if(seg->sent_us!=0){
+    seg->retransmits++;
+    socket->retransmits++;
+  }
+  seg->sent_us=now_us();
+  trace_event(socket,seg->retransmits?TRACE_RETRANSMIT:TRACE_SEND,seg->seq_end,seg->data_len);
+  if(socket->rto_undo==1){
+    /* First retransmission after a timeout, its timestamp tells original ACKs apart */
+    socket->rto_tsval=ntohl(header.future_use0);
+    socket->rto_undo=2;
+  }
+  return 0;
+}
+
+/*
+ * Forward error correction. Every fec_k new data segments are followed by
+ * a parity segment, the XOR of their payloads as sent, compressed or not.
+ * The XOR of their sequence numbers, stream offsets, lengths, streams and
+ * flags travels in its header fields, so the receiver can rebuild any
+ * single segment of the block it misses, header included. Parity segments take no sequence
+ * number and are never retransmitted.
+ */
+static uint32_t fec_meta (uint32_t len, uint32_t stream, uint32_t flags){
+  return len<<16|(flags>>5)<<8|stream;
+}
+
+/* dst ^= src, a word at a time so that the compiler vectorizes the loop */
+static void fec_xor (uint8_t *dst, const uint8_t *src, size_t len){
+  uint64_t a;
+  uint64_t b;
+  size_t i;
+  for(i=0;i+sizeof(uint64_t)<=len;i+=sizeof(uint64_t)){
+    memcpy(&a,dst+i,sizeof(uint64_t));
+    memcpy(&b,src+i,sizeof(uint64_t));
+    a^=b;
+    memcpy(dst+i,&a,sizeof(uint64_t));
+  }
+  for(;i<len;i++){
+    dst[i]^=src[i];
+  }
+}
+
+/* Sends the parity of the block being sent and opens the next block */
+static int fec_send_parity (microtcp_sock_t *socket){
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint32_t crc;
+  header=create_header(socket->fec_seq,ACK|FEC,socket->fec_len,socket->ack_number,recv_window(socket));
+  header.future_use0=htonl(socket->fec_meta);
+  header.future_use1=htonl(socket->fec_offset);
+  header.future_use2=htonl(socket->fec_block<<16|socket->fec_count);
+  crc=update_crc32(0xffffffff,(const uint8_t*)&header,sizeof(microtcp_header_t));
+  crc=update_crc32(crc,socket->fec_parity,socket->fec_len)^0xffffffff;
+  header.checksum=htonl(crc);
+  iov[0].iov_base=&header;
+  iov[0].iov_len=sizeof(microtcp_header_t);
+  iov[1].iov_base=socket->fec_parity;
+  iov[1].iov_len=socket->fec_len;
+  memset(&msg,0,sizeof(struct msghdr));
+  msg.msg_name=socket->address;
+  msg.msg_namelen=socket->address_len;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=2;
+  #ifdef  DEBUG
+  printf("Sending parity of FEC block %u, %u segments\n",socket->fec_block,socket->fec_count);
+  #endif
+  if(sendmsg(socket->sd,&msg,0)==-1){
+    perror("sending parity packet");
+    return -1;
+  }
+  socket->packets_send++;
+  memset(socket->fec_parity,0,socket->fec_len);
+  socket->fec_len=0;
+  socket->fec_seq=0;
+  socket->fec_offset=0;
+  socket->fec_meta=0;
+  socket->fec_count=0;
+  socket->fec_block=socket->fec_block%0xffff+1;
+  return 0;
+}
+
+/* Longest a partial block waits for more segments before its parity is sent */
+static uint32_t fec_wait (microtcp_sock_t *socket){
+  return socket->srtt_us/4;
+}
+
+/* Adds a new data segment, just sent, to the block being sent */
+static int fec_encode (microtcp_sock_t *socket, const microtcp_segment_t *seg){
+  const uint8_t *payload;
+  size_t len;
+  if(socket->fec_count==0){
+    socket->fec_first_us=seg->sent_us;
+  }
+  payload=segment_payload(socket,seg,&len);
+  fec_xor(socket->fec_parity,payload,len);
+  if(len>socket->fec_len){
+    socket->fec_len=len;
+  }
+  socket->fec_seq^=seg->seq_end;
+  socket->fec_offset^=seg->stream_offset;
+  socket->fec_meta^=fec_meta(len,seg->stream,seg->flags);
+  if(++socket->fec_count==socket->fec_k){
+    return fec_send_parity(socket);
+  }
+  return 0;
+}
+
+/*
+ * Changes SO_RCVTIMEO only when the requested timeout differs from the
+ * current one. 0 blocks without a timeout.
+ */
+static void set_recv_timeout (microtcp_sock_t *socket, uint32_t us){
+  struct timeval timeout;
+  if(socket->rcvtimeo_us==us){
+    return;
+  }
+  timeout.tv_sec=us/1000000;
+  timeout.tv_usec=us%1000000;
+  if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, & timeout ,sizeof( struct timeval)) < 0){
+    perror("setsockopt");
+    return;
+  }
+  socket->rcvtimeo_us=us;
+}
+
+static pthread_key_t timers_key;
+static pthread_once_t timers_once=PTHREAD_ONCE_INIT;
+
+static void timers_key_create (void){
+  if(pthread_key_create(&timers_key,free)!=0){
+    perror("creating timer wheel key");
+  }
+}
+
+/* The timer wheel of the calling thread, shared by all the sockets it drives */
+static timer_wheel_t *thread_timers (void){
+  timer_wheel_t *w;
+  pthread_once(&timers_once,timers_key_create);
+  w=pthread_getspecific(timers_key);
+  if(w==NULL){
+    w=malloc(sizeof(timer_wheel_t));
+    timer_wheel_init(w,MICROTCP_TIMER_TICK_US,now_us());
+    pthread_setspecific(timers_key,w);
+  }
+  return w;
+}
+
+static void timer_expired (timer_entry_t *t){
+  microtcp_sock_t *socket=t->arg;
+  socket->timers_fired|=1U<<(t-socket->timers);
+}
+
+/* Arms or moves a timer of the socket, the socket must stay put until timers_stop() */
+static void timer_arm (microtcp_sock_t *socket, int id, uint64_t when){
+  socket->timers[id].arg=socket;
+  timer_wheel_add(thread_timers(),&socket->timers[id],when);
+}
+
+static void timer_cancel (microtcp_sock_t *socket, int id){
+  timer_wheel_del(thread_timers(),&socket->timers[id]);
+}
+
+/* Called before a call returns, no timer of the socket outlives it */
+static void timers_stop (microtcp_sock_t *socket){
+  int i;
+  for(i=0;i<TIMER_COUNT;i++){
+    timer_cancel(socket,i);
+  }
+  socket->timers_fired=0;
+}
+
+/*
+ * Receives a datagram, waiting no longer than the earliest timer of the
+ * thread, then runs the timers that expired meanwhile. Returns -1 with
+ * errno EAGAIN when only timers fired, timers_fired tells which.
+ */
+static ssize_t timed_recvfrom (microtcp_sock_t *socket, void *buf, size_t len, int flags,
+                               struct sockaddr *from, socklen_t *from_len){
+  struct iovec iov;
+  iov.iov_base=buf;
+  iov.iov_len=len;
+  return timed_recvmsg(socket,&iov,1,flags,from,from_len);
+}
+
+/* As timed_recvfrom(), scattering the datagram over the given buffers */
+static ssize_t timed_recvmsg (microtcp_sock_t *socket, struct iovec *iov, int iovcnt, int flags,
+                              struct sockaddr *from, socklen_t *from_len){
+  timer_wheel_t *w=thread_timers();
+  uint64_t now=now_us();
+  uint64_t next=timer_wheel_next(w);
+  struct msghdr msg;
+  ssize_t status;
+  socket->timers_fired=0;
+  if(!(flags&MSG_DONTWAIT)){
+    if(next<=now){
+      set_recv_timeout(socket,1);
+    }else if(next-now<MICROTCP_ACK_TIMEOUT_US){
+      set_recv_timeout(socket,next-now);
+    }else{
+      set_recv_timeout(socket,MICROTCP_ACK_TIMEOUT_US);
+    }
+  }
+  memset(&msg,0,sizeof(struct msghdr));
+  msg.msg_name=from;
+  msg.msg_namelen=(from_len!=NULL)?*from_len:0;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=iovcnt;
+  status=recvmsg(socket->sd,&msg,flags);
+  if(status!=-1 && from_len!=NULL){
+    *from_len=msg.msg_namelen;
+  }
+  timer_wheel_advance(w,now_us());
+  return status;
+}
+
+/* RFC 6298 smoothing of a new RTT sample */
+static void rtt_sample (microtcp_sock_t *socket, uint32_t rtt){
+  uint32_t delta;
+  if(socket->srtt_us==0){
+    socket->srtt_us=rtt;
+    socket->rttvar_us=rtt/2;
+  }else{
+    delta=(rtt>socket->srtt_us)?rtt-socket->srtt_us:socket->srtt_us-rtt;
+    socket->rttvar_us=(3*socket->rttvar_us+delta)/4;
+    socket->srtt_us=(7*socket->srtt_us+rtt)/8;
+  }
+  if(socket->min_rtt_us==0 || rtt<socket->min_rtt_us){
+    socket->min_rtt_us=rtt;
+  }
+  histogram_record(&socket->rtt_hist,rtt);
+}
+
+/* Retransmission timeout, never below MICROTCP_ACK_TIMEOUT_US */
+static uint32_t rto_timeout (microtcp_sock_t *socket){
+  uint32_t rto=socket->srtt_us+4*socket->rttvar_us;
+  return (rto>MICROTCP_ACK_TIMEOUT_US)?rto:MICROTCP_ACK_TIMEOUT_US;
+}
+
+/* Time a segment sent before the last delivered one may stay unacknowledged before RACK calls it lost */
+static uint64_t rack_timeout (microtcp_sock_t *socket, int dup_acks){
+  uint32_t reo_wnd;
+  if(socket->srtt_us==0){
+    return MICROTCP_ACK_TIMEOUT_US;
+  }
+  /* Three duplicate ACKs mean real loss rather than reordering */
+  reo_wnd=(dup_acks>=3)?0:socket->min_rtt_us/4;
+  if(socket->fec_k>0){
+    /* Leave the parity of the block time to arrive and repair the loss */
+    reo_wnd+=fec_wait(socket)+socket->min_rtt_us/4;
+  }
+  return socket->srtt_us+reo_wnd;
+}
+
+/* Earliest time a segment sent before rack_xmit_us will be declared lost, 0 if none is pending */
+static uint64_t rack_deadline (microtcp_sock_t *socket, int dup_acks){
+  microtcp_retransq_t *q=&socket->retransq;
+  microtcp_segment_t *seg;
+  uint64_t deadline=0;
+  size_t i;
+  for(i=0;i<q->count;i++){
+    seg=retransq_at(q,i);
+    if(seg->lost || seg->sent_us>=socket->rack_xmit_us){
+      continue;
+    }
+    if(deadline==0 || seg->sent_us+rack_timeout(socket,dup_acks)<deadline){
+      deadline=seg->sent_us+rack_timeout(socket,dup_acks);
+    }
+  }
+  return deadline;
+}
+
+static void enter_recovery (microtcp_sock_t *socket){
+  if(socket->in_recovery){
+    return;
+  }
+  socket->ssthresh=(socket->cwnd/2>2*SEGMENT_PAYLOAD(socket))?socket->cwnd/2:2*SEGMENT_PAYLOAD(socket);
+  socket->cwnd=socket->ssthresh;
+  socket->in_recovery=1;
+  socket->recovery_seq=socket->seq_number;
+  trace_event(socket,TRACE_LOSS,socket->seq_number,0);
+}
+
+/*
+ * RACK: a segment is lost once a segment sent after it has been delivered
+ * and it stays unacknowledged for longer than an RTT plus the reordering window.
+ * The receiver drops everything after a hole (go-back-N), so the rest of the queue goes with it.
+ */
+static int rack_detect_loss (microtcp_sock_t *socket, uint64_t now, int dup_acks){
+  microtcp_retransq_t *q=&socket->retransq;
+  microtcp_segment_t *seg;
+  size_t i;
+  for(i=0;i<q->count;i++){
+    seg=retransq_at(q,i);
+    if(!seg->lost && seg->sent_us<socket->rack_xmit_us && seg->sent_us+rack_timeout(socket,dup_acks)<=now){
+      break;
+    }
+  }
+  if(i==q->count){
+    return 0;
+  }
+  #ifdef  DEBUG
+  printf("RACK marked sequence number %u lost\n",seg->seq_end);
+  #endif
+  enter_recovery(socket);
+  retransq_mark_lost(socket,i);
+  return 1;
+}
+
+/*
+ * Eifel detection: the first ACK after a timeout echoes the timestamp of the
+ * original transmission, so the ACKs were only late. Restore the congestion
+ * state and stop resending what the peer already has.
+ */
+static void spurious_timeout_undo (microtcp_sock_t *socket){
+  microtcp_retransq_t *q=&socket->retransq;
+  microtcp_segment_t *seg;
+  size_t i;
+  #ifdef  DEBUG
+  printf("Spurious timeout, restoring cwnd %lu and ssthresh %lu\n",socket->prior_cwnd,socket->prior_ssthresh);
+  #endif
+  socket->cwnd=socket->prior_cwnd;
+  socket->ssthresh=socket->prior_ssthresh;
+  socket->in_recovery=socket->prior_in_recovery;
+  socket->spurious_timeouts++;
+  for(i=0;i<q->count;i++){
+    seg=retransq_at(q,i);
+    if(seg->lost){
+      seg->lost=0;
+      q->bytes_in_flight+=seg->data_len;
+      socket->packets_lost--;
+      socket->bytes_lost-=seg->data_len;
+    }
+  }
+  trace_event(socket,TRACE_UNDO,socket->seq_number,0);
+}
+
+/* Probe timeout, about two RTTs after the last transmission or ACK */
+static uint64_t tlp_deadline (microtcp_sock_t *socket){
+  microtcp_retransq_t *q=&socket->retransq;
+  uint64_t last;
+  uint32_t pto;
+  if(socket->srtt_us==0 || socket->tlp_outstanding || socket->in_recovery || q->bytes_in_flight==0){
+    return 0;
+  }
+  pto=(2*socket->srtt_us>MICROTCP_TLP_MIN_US)?2*socket->srtt_us:MICROTCP_TLP_MIN_US;
+  if(pto>=rto_timeout(socket)){
+    return 0;
+  }
+  last=retransq_at(q,q->count-1)->sent_us;
+  if(socket->last_ack_us>last){
+    last=socket->last_ack_us;
+  }
+  return last+pto;
+}
+
+static const uint8_t probe_padding[MICROTCP_MAX_MSS];
+
+static void plpmtu_probe_failed (microtcp_sock_t *socket){
+  #ifdef  DEBUG
+  printf("PLPMTU probe of %lu bytes failed\n",socket->probe_size);
+  #endif
+  socket->probe_high=socket->probe_size;
+  socket->probe_size=0;
+  socket->probe_count=0;
+  if(socket->probe_high-socket->mss<=MICROTCP_PLPMTU_MIN_STEP){
+    socket->plpmtu_state=PLPMTU_SEARCH_COMPLETE;
+  }
+}
+
+/* The peer received a probe of the given size, segments of that size fit the path */
+static void plpmtu_probe_acked (microtcp_sock_t *socket, uint32_t size){
+  if(socket->probe_size==0 || size!=socket->probe_size){
+    return;
+  }
+  #ifdef  DEBUG
+  printf("PLPMTU probe of %u bytes acknowledged\n",size);
+  #endif
+  socket->mss=size;
+  socket->probe_size=0;
+  socket->probe_count=0;
+  if(socket->probe_high-socket->mss<=MICROTCP_PLPMTU_MIN_STEP){
+    socket->plpmtu_state=PLPMTU_SEARCH_COMPLETE;
+  }
+}
+
+/*
+ * Sends a padding-only probe that uses no sequence space, so losing it
+ * says nothing about congestion. The largest negotiated size is tried
+ * first, then the search bisects between the current MSS and the last failure.
+ */
+static void plpmtu_probe (microtcp_sock_t *socket, uint64_t now){
+  microtcp_header_t header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  uint32_t crc;
+
+  if(socket->plpmtu_state!=PLPMTU_SEARCHING || socket->in_recovery){
+    return;
+  }
+  if(socket->probe_size!=0){
+    if(now<socket->probe_sent_us+rto_timeout(socket)){
+      return;
+    }
+    if(socket->probe_count>=MICROTCP_PLPMTU_MAX_PROBES){
+      plpmtu_probe_failed(socket);
+      if(socket->plpmtu_state!=PLPMTU_SEARCHING){
+        return;
+      }
+    }
+  }
+  if(socket->probe_size==0){
+    socket->probe_size=(socket->probe_high==socket->max_mss+1)?socket->max_mss:(socket->mss+socket->probe_high)/2;
+  }
+
+  header=create_header(socket->seq_number,ACK|PROBE,socket->probe_size-sizeof(microtcp_header_t),socket->ack_number,recv_window(socket));
+  crc=update_crc32(0xffffffff,(const uint8_t*)&header,sizeof(microtcp_header_t));
+  crc=update_crc32(crc,probe_padding,socket->probe_size-sizeof(microtcp_header_t))^0xffffffff;
+  header.checksum=htonl(crc);
+  iov[0].iov_base=&header;
+  iov[0].iov_len=sizeof(microtcp_header_t);
+  iov[1].iov_base=(void*)probe_padding;
+  iov[1].iov_len=socket->probe_size-sizeof(microtcp_header_t);
+  memset(&msg,0,sizeof(struct msghdr));
+  msg.msg_name=socket->address;
+  msg.msg_namelen=socket->address_len;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=2;
+  if(sendmsg(socket->sd,&msg,0)==-1){
+    if(errno==EMSGSIZE){
+      /* Larger than the local interface allows */
+      plpmtu_probe_failed(socket);
+    }
+    return;
+  }
+  socket->packets_send++;
+  socket->probe_count++;
+  socket->probe_sent_us=now;
+}
+
+/* Answers a path MTU probe of the peer with the size that got through */
+static void plpmtu_reply (microtcp_sock_t *socket, uint32_t size){
+  microtcp_header_t header;
+  header=create_header(socket->seq_number,ACK|PROBE,0,socket->ack_number,recv_window(socket));
+  header.future_use2=htonl(size);
+  header.checksum=htonl(crc32((uint8_t*)&header,sizeof(microtcp_header_t)));
+  if(sendto(socket->sd,(void*)&header,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
+    perror("sending probe ACK");
+    return;
+  }
+  socket->packets_send++;
+}
+
+/* Segments and sends the buffer, returning once the peer has acknowledged all of it */
+/* A buffer being sent on a stream by send_segments() */
+typedef struct
+{
+    uint32_t stream;
+    const uint8_t *data;
+    size_t length;
+    uint32_t offset;            /* Stream offset of data[0] */
+    size_t queued;              /* Bytes handed to the retransmission queue */
+    size_t acked;               /* Bytes acknowledged */
+    int eor;                    /* A message, its last segment carries EOR */
+    uint64_t deadline;          /* When the message is abandoned, 0 for never */
+    int abandoned;
+} send_chunk_t;
+
+/* Some data is still to be delivered, abandoned messages aside */
+static int chunks_pending (const send_chunk_t *chunks, size_t count){
+    size_t i;
+    for(i = 0; i < count; i++){
+        if(!chunks[i].abandoned && chunks[i].acked<chunks[i].length){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Every chunk has all of its data in the retransmission queue */
+static int chunks_queued (const send_chunk_t *chunks, size_t count){
+    size_t i;
+    for(i = 0; i < count; i++){
+        if(chunks[i].queued<chunks[i].length){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Gives up on a message past its deadline. Its segments leave the queue
+ * and a SKIP segment taking one sequence number replaces them. It is
+ * retransmitted like data until acknowledged, and moves the peer past
+ * everything up to it and past the end of the message in its stream.
+ * The message must be alone in the queue, as with microtcp_send_msg().
+ */
+static void abandon_chunk (microtcp_sock_t *socket, send_chunk_t *c){
+    microtcp_retransq_t *q=&socket->retransq;
+    microtcp_segment_t *seg;
+    uint32_t start=(q->count>0)?retransq_at(q,0)->seq_start:socket->seq_number;
+    #ifdef  DEBUG
+    printf("Abandoning a message of stream %u, %zu of %zu bytes acknowledged\n",c->stream,c->acked,c->length);
+    #endif
+    socket->streams[c->stream].unacked=0;
+    q->head=0;
+    q->count=0;
+    q->bytes_in_flight=0;
+    seg=retransq_push(q,start,NULL,0,c->stream,c->offset+c->length);
+    seg->seq_end=++socket->seq_number;
+    seg->flags=SKIP;
+    /* Sent by the retransmission loop */
+    seg->lost=1;
+    c->queued=c->length;
+    c->abandoned=1;
+}
+
+/*
+ * A duplicate ACK as RFC 5681 defines it: a pure ACK that acknowledges
+ * nothing new, without data, and leaves the window of its stream as the
+ * last ACK for the stream set it. Window updates are not duplicates.
+ */
+static int dup_ack (const microtcp_sock_t *socket, const microtcp_header_t *header, uint32_t snd_una){
+    return header->control==ACK && header->data_len==0 && header->ack_number==snd_una
+           && header->future_use2<MICROTCP_MAX_STREAMS
+           && header->window==socket->streams[header->future_use2].ack_win;
+}
+
+/* Bytes the peer still takes on a stream */
+static size_t stream_credit (const microtcp_stream_t *st){
+    return (st->peer_win>st->unacked)?st->peer_win-st->unacked:0;
+}
+
+/* The chunk a queued segment was cut from */
+static send_chunk_t *chunk_of (send_chunk_t *chunks, size_t count, const microtcp_segment_t *seg){
+    size_t i;
+    for(i = 0; i < count; i++){
+        if(chunks[i].stream==seg->stream && seg->stream_offset-chunks[i].offset<chunks[i].length){
+            return &chunks[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Picks the chunk for the next new segment, taking turns so that every
+ * stream makes progress. A chunk waits for the chunks before it on the
+ * same stream, and for window on its stream.
+ */
+static send_chunk_t *next_chunk (microtcp_sock_t *socket, send_chunk_t *chunks, size_t count, size_t *turn){
+    send_chunk_t *c;
+    size_t i;
+    size_t j;
+    for(i = 0; i < count; i++){
+        c=&chunks[(*turn+i)%count];
+        if(c->queued==c->length || stream_credit(&socket->streams[c->stream])==0){
+            continue;
+        }
+        for(j = 0; &chunks[j] != c && (chunks[j].stream!=c->stream || chunks[j].queued==chunks[j].length); j++);
+        if(&chunks[j]==c){
+            *turn=(*turn+i+1)%count;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Compresses the data of the next segment into socket->ztx, taking as much
+ * of len as fits. Returns the bytes of data taken, or 0 if the segment is
+ * better sent uncompressed. Data that does not compress is skipped for a
+ * few segments, more after every failure, so it costs little.
+ */
+static size_t compress_segment (microtcp_sock_t *socket, const uint8_t *data, size_t len){
+    size_t payload=SEGMENT_PAYLOAD(socket);
+    size_t consumed=(len<LZ_MAX_INPUT)?len:LZ_MAX_INPUT;
+    size_t zlen;
+    if(len<ZMIN_LEN){
+        return 0;
+    }
+    if(socket->zskip>0){
+        socket->zskip--;
+        return 0;
+    }
+    zlen=lz_compress(data,&consumed,socket->ztx,payload);
+    socket->ztx_len=0;
+    /* Worth it if it saves an eighth and carries more than an uncompressed segment would */
+    if(zlen==0 || 8*zlen>7*consumed || consumed<((len<payload)?len:payload)){
+        socket->zskip=socket->zbackoff;
+        socket->zbackoff=(socket->zbackoff<ZSKIP_MAX)?2*socket->zbackoff:ZSKIP_MAX;
+        socket->zhold=0;
+        return 0;
+    }
+    socket->zbackoff=1;
+    socket->ztx_len=zlen;
+    /* With some slack, what microtcp_send() gathers should fit in one segment */
+    socket->zhold=consumed*payload/zlen*7/8;
+    if(socket->zhold>LZ_MAX_INPUT){
+        socket->zhold=LZ_MAX_INPUT;
+    }
+    return consumed;
+}
+
+/* Asks the peer for the window of a stream it has closed */
+static int send_window_probe (microtcp_sock_t *socket, uint32_t stream){
+    microtcp_header_t header;
+    header=create_header(socket->seq_number,ACK,0,socket->ack_number,recv_window(socket));
+    header.future_use2=htonl(stream);
+    header.checksum=htonl(crc32((uint8_t*)&header,sizeof(microtcp_header_t)));
+    #ifdef  DEBUG
+    printf("Sending window probe for stream %u\n",stream);
+    #endif
+    if(sendto(socket->sd,(void*)&header,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
+        perror("sending window probe");
+        return -1;
+    }
+    socket->packets_send++;
+    return 0;
+}
+
+static ssize_t send_segments (microtcp_sock_t *socket, send_chunk_t *chunks, size_t count){
+    microtcp_retransq_t *q=&socket->retransq;
+    microtcp_segment_t *seg;
+    microtcp_stream_t *st;
+    microtcp_header_t header;
+    send_chunk_t *c;
     char recv_buf[MICROTCP_RECVBUF_LEN];
-    int cwnd;
+    size_t data_sent=0;
+    size_t window;
+    size_t bytes_to_send;
+    size_t zbytes;
+    size_t acked;
+    size_t turn=0;
+    size_t i;
+    uint32_t snd_una=socket->seq_number;
+    int dup_acks=0;
+    int probes=0;               /* Window probes whose answer has not come yet */
     int status;
-    int cwnd_inc=0;
-    struct timeval timeout;
-
-    timeout. tv_sec = 0;
-    timeout. tv_usec = MICROTCP_ACK_TIMEOUT_US;
-    if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, & timeout ,sizeof( struct timeval)) < 0){
-        perror("setsockopt");
-    }
-    int starting_seq;
-    while( data_sent < length){
-        starting_seq=socket->seq_number;
-        bytes_to_send = min( socket->curr_win_size , socket->cwnd ,remaining);
-        chunks = bytes_to_send / MAX_PAYLOAD_SIZE;
-        for(i = 0; i < chunks;i++){
-            header=create_header(socket->seq_number+MAX_PAYLOAD_SIZE,ACK,MAX_PAYLOAD_SIZE,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-            send_buf=calloc(1,MICROTCP_MSS);
-            memcpy(send_buf,&header,sizeof(microtcp_header_t));
-            memcpy(send_buf+sizeof(microtcp_header_t),buffer+data_sent+i*MAX_PAYLOAD_SIZE,MAX_PAYLOAD_SIZE);
-            header.checksum=htonl(crc32((uint8_t*)send_buf,MICROTCP_MSS));
-            memcpy(send_buf,&header,sizeof(microtcp_header_t));
-            //print
+    uint64_t now;
+    uint64_t rack;
+    uint64_t tlp;
+    uint64_t delivered;
+    unsigned int fired;
+
+    for(i = 0; i < count; i++){
+        st=&socket->streams[chunks[i].stream];
+        chunks[i].offset=st->send_offset;
+        chunks[i].queued=0;
+        chunks[i].acked=0;
+        chunks[i].abandoned=0;
+        st->send_offset+=chunks[i].length;
+    }
+    while(chunks_pending(chunks,count) || q->count>0){
+        now=now_us();
+        for(i = 0; i < count; i++){
+            if(chunks[i].deadline!=0 && now>=chunks[i].deadline && !chunks[i].abandoned && chunks[i].acked<chunks[i].length){
+                abandon_chunk(socket,&chunks[i]);
+            }
+        }
+        window=(socket->cwnd<INT32_MAX)?socket->cwnd:INT32_MAX;
+        /* Retransmit the segments marked lost, then fill the window with new data */
+        for(i = 0; i < q->count && q->bytes_in_flight < window; i++){
+            seg=retransq_at(q,i);
+            if(seg->lost){
+                seg->lost=0;
+                q->bytes_in_flight+=seg->data_len;
+                if(transmit_segment(socket,seg)==-1){
+                    return -1;
+                }
+            }
+        }
+        while(q->bytes_in_flight < window && q->count < MICROTCP_RETRANSQ_LEN
+              && (c=next_chunk(socket,chunks,count,&turn))!=NULL){
+            st=&socket->streams[c->stream];
+            bytes_to_send=min(socket->compress?LZ_MAX_INPUT:SEGMENT_PAYLOAD(socket),window-q->bytes_in_flight,c->length-c->queued);
+            if(bytes_to_send>stream_credit(st)){
+                bytes_to_send=stream_credit(st);
+            }
+            /* Compressed, a segment carries as much data as fits in it once compressed */
+            zbytes=socket->compress?compress_segment(socket,c->data+c->queued,bytes_to_send):0;
+            if(zbytes>0){
+                bytes_to_send=zbytes;
+            }else if(bytes_to_send>SEGMENT_PAYLOAD(socket)){
+                bytes_to_send=SEGMENT_PAYLOAD(socket);
+            }
+            seg=retransq_push(q,socket->seq_number,c->data+c->queued,bytes_to_send,c->stream,c->offset+c->queued);
+            if(c->eor && c->queued+bytes_to_send==c->length){
+                seg->flags=EOR;
+            }
+            if(zbytes>0){
+                seg->flags|=COMPRESSED;
+                socket->ztx_seq=seg->seq_end;
+            }
+            seg->fec_block=(socket->fec_k>0)?socket->fec_block:0;
+            if(transmit_segment(socket,seg)==-1){
+                return -1;
+            }
+            if(socket->fec_k>0 && fec_encode(socket,seg)==-1){
+                return -1;
+            }
+            socket->seq_number+=bytes_to_send;
+            st->unacked+=bytes_to_send;
+            c->queued+=bytes_to_send;
+        }
+        /*
+         * A partial block ends with the data, or once it waited a while for
+         * more, its parity must reach the peer before the loss is detected
+         */
+        if(socket->fec_count>0 && (chunks_queued(chunks,count) || now_us()-socket->fec_first_us>=fec_wait(socket))){
+            if(fec_send_parity(socket)==-1){
+                return -1;
+            }
+        }
+        if(socket->plpmtu_state==PLPMTU_SEARCHING){
+            plpmtu_probe(socket,now_us());
+        }
+    /* Get the ACKs, the timers wake us up for the RTO, RACK and probe deadlines */
+        now=now_us();
+        if(q->count>0){
+            timer_arm(socket,TIMER_RTO,retransq_at(q,0)->sent_us+rto_timeout(socket));
+            timer_cancel(socket,TIMER_PERSIST);
+            socket->persist_us=0;
+        }else{
+            /*
+             * Nothing in flight with data left, the peer has closed the window.
+             * Its window update reopens it, the probes are for when that is lost.
+             */
+            timer_cancel(socket,TIMER_RTO);
+            if(!timer_pending(&socket->timers[TIMER_PERSIST])){
+                if(socket->persist_us==0){
+                    socket->persist_us=rto_timeout(socket);
+                }
+                timer_arm(socket,TIMER_PERSIST,now+socket->persist_us);
+            }
+        }
+        rack=rack_deadline(socket,dup_acks);
+        tlp=tlp_deadline(socket);
+        if(rack!=0){
+            timer_arm(socket,TIMER_RACK,rack);
+        }else{
+            timer_cancel(socket,TIMER_RACK);
+        }
+        if(tlp!=0){
+            timer_arm(socket,TIMER_TLP,tlp);
+        }else{
+            timer_cancel(socket,TIMER_TLP);
+        }
+        if(socket->fec_count>0){
+            timer_arm(socket,TIMER_FEC,socket->fec_first_us+fec_wait(socket));
+        }else{
+            timer_cancel(socket,TIMER_FEC);
+        }
+        timer_cancel(socket,TIMER_EXPIRE);
+        for(i = 0; i < count; i++){
+            if(chunks[i].deadline!=0 && !chunks[i].abandoned){
+                timer_arm(socket,TIMER_EXPIRE,chunks[i].deadline);
+            }
+        }
+        status=timed_recvfrom(socket,(void*)recv_buf,MICROTCP_RECVBUF_LEN,0,(struct sockaddr*)socket->address,&socket->address_len);
+        if(status==-1){
+            fired=socket->timers_fired;
+            if(fired&(1U<<TIMER_PERSIST)){
+                /* Probe the streams the peer has closed, backing off while they stay closed */
+                for(i = 0; i < count; i++){
+                    st=&socket->streams[chunks[i].stream];
+                    if(chunks[i].queued<chunks[i].length && stream_credit(st)==0){
+                        if(send_window_probe(socket,chunks[i].stream)==-1){
+                            return -1;
+                        }
+                        probes++;
+                    }
+                }
+                socket->persist_us=(socket->persist_us<MICROTCP_PERSIST_MAX_US/2)?2*socket->persist_us:MICROTCP_PERSIST_MAX_US;
+                timer_arm(socket,TIMER_PERSIST,now_us()+socket->persist_us);
+            }
+            if(fired&((1U<<TIMER_PERSIST)|(1U<<TIMER_EXPIRE)|(1U<<TIMER_FEC))){
+                /* A message expired or a block is due */
+                continue;
+            }
+            now=now_us();
+            if(fired&(1U<<TIMER_RACK)){
+                rack_detect_loss(socket,now,dup_acks);
+                continue;
+            }
+            if((fired&(1U<<TIMER_TLP)) && !(fired&(1U<<TIMER_RTO))){
+                //tail loss probe, resend the last segment to trigger an ACK
+                #ifdef  DEBUG
+                printf("Sending tail loss probe\n");
+                #endif
+                socket->tlp_outstanding=1;
+                if(transmit_segment(socket,retransq_at(q,q->count-1))==-1){
+                    return -1;
+                }
+                continue;
+            }
+            if(!(fired&(1U<<TIMER_RTO))){
+                continue;
+            }
             #ifdef  DEBUG
-            printf("Sending packet with sequence number: %lu, i: %d, chunks: %d\n",socket->seq_number+MAX_PAYLOAD_SIZE,i,chunks);
+            printf("Inside Time Out\n");
             #endif
-            if(sendto(socket->sd,send_buf,MICROTCP_MSS,flags,(struct sockaddr*)socket->address,socket->address_len)==-1){
-                perror("sending packet");
-                exit(EXIT_FAILURE);
+            socket->timeouts++;
+            if(socket->rto_undo==0){
+                /* Remember the congestion state in case the timeout turns out spurious */
+                socket->prior_cwnd=socket->cwnd;
+                socket->prior_ssthresh=socket->ssthresh;
+                socket->prior_in_recovery=socket->in_recovery;
+                socket->rto_undo=1;
+            }
+            socket->ssthresh=(socket->cwnd/2>2*SEGMENT_PAYLOAD(socket))?socket->cwnd/2:2*SEGMENT_PAYLOAD(socket);
+            if(socket->mss>MICROTCP_MSS && ++socket->rto_count>=2){
+                /* Path MTU black hole, fall back to the base MSS and re-segment from the last ACK */
+                socket->probe_high=socket->mss;
+                socket->mss=MICROTCP_MSS;
+                socket->probe_size=0;
+                socket->plpmtu_state=PLPMTU_SEARCHING;
+                socket->rto_undo=0;
+                socket->seq_number=snd_una;
+                for(i = 0; i < q->count; i++){
+                    seg=retransq_at(q,i);
+                    socket->streams[seg->stream].unacked-=seg->data_len;
+                }
+                q->head=0;
+                q->count=0;
+                q->bytes_in_flight=0;
+                for(i = 0; i < count; i++){
+                    if(chunks[i].abandoned){
+                        /* The SKIP segment went with the queue, it goes first again */
+                        abandon_chunk(socket,&chunks[i]);
+                    }else{
+                        chunks[i].queued=chunks[i].acked;
+                    }
+                }
+            }
+            socket->cwnd=SEGMENT_PAYLOAD(socket);
+            socket->in_recovery=1;
+            socket->recovery_seq=socket->seq_number;
+            retransq_mark_lost(socket,0);
+            trace_event(socket,TRACE_TIMEOUT,snd_una,0);
+            dup_acks=0;
+            continue;
+        }
+        if(parse_segment((const uint8_t*)recv_buf,status,&header)==-1){
+            perror("checksum error 7");
+            continue;
+        }
+        socket->packets_received++;
+        if(header.control==SYNACK){
+            /* Our handshake ACK was lost */
+            send_ack(socket);
+            continue;
+        }
+        if(keepalive_input(socket,&header)){
+            continue;
+        }
+        if(header.control==(ACK|PROBE)){
+            if(header.data_len==0){
+                plpmtu_probe_acked(socket,header.future_use2);
+            }
+            continue;
+        }
+        //print
+        #ifdef  DEBUG
+        printf("Received ACK packet with ack number: %u\n",header.ack_number);
+        #endif
+        now=now_us();
+        socket->last_ack_us=now;
+        if(seq_before(snd_una,header.ack_number)){
+            /* The newest segment covered by this ACK drives RACK */
+            for(i = 0; i < q->count && !seq_before(header.ack_number,retransq_at(q,i)->seq_end); i++){
+                seg=retransq_at(q,i);
+                st=&socket->streams[seg->stream];
+                st->unacked-=seg->data_len;
+                if(seg->stream!=header.future_use2){
+                    /* No news about the window of this stream, its right edge stays put */
+                    st->peer_win-=(seg->data_len<st->peer_win)?seg->data_len:st->peer_win;
+                }
+                if((c=chunk_of(chunks,count,seg))!=NULL){
+                    c->acked+=seg->data_len;
+                }
+            }
+            if(i>0){
+                /* The echoed timestamp identifies the copy that arrived, even for retransmissions */
+                if(header.future_use1!=0){
+                    rtt_sample(socket,(uint32_t)now-header.future_use1);
+                }else if(seg->retransmits==0){
+                    rtt_sample(socket,now-seg->sent_us);
+                }
+                if(seg->sent_us>socket->rack_xmit_us){
+                    socket->rack_xmit_us=seg->sent_us;
+                }
+            }
+            if(socket->rto_undo==2){
+                if(header.future_use1!=0 && seq_before(header.future_use1,socket->rto_tsval)){
+                    spurious_timeout_undo(socket);
+                }
+                socket->rto_undo=0;
+            }
+            acked=retransq_ack(q,header.ack_number);
+            snd_una=header.ack_number;
+            data_sent+=acked;
+            dup_acks=0;
+            socket->rto_count=0;
+            socket->tlp_outstanding=0;
+            if(socket->in_recovery && !seq_before(snd_una,socket->recovery_seq)){
+                socket->in_recovery=0;
+            }
+            if(socket->in_recovery){
+                //no window growth while repairing a loss
+            }else if(socket->cwnd<=socket->ssthresh){
+                //slow start, counting the bytes acknowledged since the receiver delays its ACKs (RFC 3465)
+                socket->cwnd+=(acked<2*SEGMENT_PAYLOAD(socket))?acked:2*SEGMENT_PAYLOAD(socket);
+            }else{
+                //congestion avoidance, about one MSS per round trip
+                socket->cwnd+=SEGMENT_PAYLOAD(socket)*acked/socket->cwnd+1;
+            }
+            trace_event(socket,TRACE_ACK,snd_una,acked);
+            rack_detect_loss(socket,now,dup_acks);
+        }else if(probes>0 && header.ack_number==snd_una){
+            /* The answer to a window probe, nothing new was delivered */
+            probes--;
+        }else if(q->count>0 && dup_ack(socket,&header,snd_una)){
+            /* A duplicate ACK means a segment sent after the head has been delivered */
+            dup_acks++;
+            socket->dup_acks++;
+            trace_event(socket,TRACE_DUP_ACK,header.ack_number,0);
+            seg=retransq_at(q,0);
+            if(header.future_use0!=0){
+                /* The peer got the segment sent at that time past the hole, RACK moves up to it */
+                delivered=now-(uint32_t)((uint32_t)now-header.future_use0);
+                if(delivered>socket->rack_xmit_us){
+                    socket->rack_xmit_us=delivered;
+                }
+                rack_detect_loss(socket,now,dup_acks);
+            }else if(dup_acks==3 && seg->retransmits==0 && !seg->lost){
+                /* Nothing tells what the peer got, the third one is the classic fast retransmit (RFC 5681) */
+                enter_recovery(socket);
+                retransq_mark_lost(socket,0);
+            }else{
+                rack_detect_loss(socket,now,dup_acks);
+            }
+        }
+        if(header.future_use2<MICROTCP_MAX_STREAMS){
+            socket->streams[header.future_use2].peer_win=header.window;
+            socket->streams[header.future_use2].ack_win=header.window;
+            if(header.future_use2==0){
+                socket->curr_win_size=header.window;
+            }
+        }
+     }
+    return data_sent;
+}
+
+/* Sends the data on stream 0 and waits until all of it is acknowledged */
+static ssize_t send_data (microtcp_sock_t *socket, const void *buffer, size_t length){
+    send_chunk_t chunk;
+    ssize_t sent;
+    chunk.stream=0;
+    chunk.data=(const uint8_t*)buffer;
+    chunk.length=length;
+    chunk.eor=0;
+    chunk.deadline=0;
+    sent=send_segments(socket,&chunk,1);
+    timers_stop(socket);
+    return sent;
+}
+
+static int sndbuf_flush (microtcp_sock_t *socket){
+    size_t len=socket->sndbuf_len;
+    if(len==0){
+        return 0;
+    }
+    socket->cork_deadline=0;
+    socket->sndbuf_len=0;
+    return (send_data(socket,socket->sndbuf,len)==(ssize_t)len)?0:-1;
+}
+
+ssize_t microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length, int flags){
+    /* Compressing, enough data is gathered to fill a segment once compressed */
+    size_t payload=(socket->zhold>SEGMENT_PAYLOAD(socket))?socket->zhold:SEGMENT_PAYLOAD(socket);
+    size_t consumed=0;
+    size_t tail=0;
+    /*
+     * Nothing is in flight between calls, all was acknowledged before the
+     * last one returned, so Nagle would send a partial segment right away.
+     * Only MICROTCP_CORK and MSG_MORE hold it, until a send past MICROTCP_CORK_US.
+     */
+    int hold=socket->cork || (flags&MSG_MORE);
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    /* Held data past its deadline goes out on its own */
+    if(socket->sndbuf_len>0 && now_us()>=socket->cork_deadline && sndbuf_flush(socket)==-1){
+        return -1;
+    }
+    if(socket->sndbuf_len>0){
+        /* Complete the held partial segment first */
+        consumed=(socket->sndbuf_len<payload)?payload-socket->sndbuf_len:0;
+        if(consumed>length){
+            consumed=length;
+        }
+        memcpy(socket->sndbuf+socket->sndbuf_len,buffer,consumed);
+        socket->sndbuf_len+=consumed;
+        if(socket->sndbuf_len<payload && hold){
+            return length;
+        }
+        if(sndbuf_flush(socket)==-1){
+            return -1;
+        }
+    }
+    if(hold){
+        tail=(length-consumed)%payload;
+    }
+    if(length-consumed-tail>0 && send_data(socket,(const uint8_t*)buffer+consumed,length-consumed-tail)==-1){
+        return -1;
+    }
+    memcpy(socket->sndbuf,(const uint8_t*)buffer+length-tail,tail);
+    socket->sndbuf_len=tail;
+    if(tail>0){
+        socket->cork_deadline=now_us()+MICROTCP_CORK_US;
+    }
+    return length;
+}
+
+/*
+ * Cuts the buffers into chunks of stream 0 that are whole segments, so no
+ * segment ends at a buffer boundary. Segments within a buffer reference
+ * it, a segment spanning a boundary is gathered in seams, payload bytes
+ * per boundary. Returns the number of chunks, at most 2 * iovcnt.
+ */
+static size_t iov_chunks (const struct iovec *iov, int iovcnt, size_t payload, uint8_t *seams, send_chunk_t *chunks){
+    size_t count=0;
+    size_t pos=0;
+    size_t avail;
+    size_t n;
+    size_t fill;
+    int i=0;
+    int last;
+    for(last = iovcnt - 1; last >= 0 && iov[last].iov_len == 0; last--);
+    while(i <= last){
+        avail=iov[i].iov_len-pos;
+        if(avail==0){
+            i++;
+            pos=0;
+            continue;
+        }
+        chunks[count].stream=0;
+        chunks[count].eor=0;
+        chunks[count].deadline=0;
+        if(avail>=payload || i==last){
+            n=(i==last)?avail:avail-avail%payload;
+            chunks[count].data=(const uint8_t*)iov[i].iov_base+pos;
+            chunks[count++].length=n;
+            pos+=n;
+            continue;
+        }
+        /* Less than a segment is left, the next buffers complete it */
+        for(fill = 0; fill < payload && i <= last; ){
+            n=(iov[i].iov_len-pos<payload-fill)?iov[i].iov_len-pos:payload-fill;
+            memcpy(seams+fill,(const uint8_t*)iov[i].iov_base+pos,n);
+            fill+=n;
+            pos+=n;
+            if(pos==iov[i].iov_len){
+                i++;
+                pos=0;
+            }
+        }
+        chunks[count].data=seams;
+        chunks[count++].length=fill;
+        seams+=payload;
+    }
+    return count;
+}
+
+ssize_t microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt){
+    send_chunk_t *chunks;
+    uint8_t *seams;
+    size_t payload=SEGMENT_PAYLOAD(socket);
+    size_t count;
+    ssize_t sent;
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    if(iovcnt<0){
+        errno=EINVAL;
+        return -1;
+    }
+    /* What microtcp_send() holds goes first */
+    if(sndbuf_flush(socket)==-1){
+        return -1;
+    }
+    chunks=malloc(2*(iovcnt+1)*sizeof(send_chunk_t));
+    seams=malloc((iovcnt+1)*payload);
+    if(chunks==NULL || seams==NULL){
+        perror("allocating iovec chunks");
+        free(chunks);
+        free(seams);
+        return -1;
+    }
+    count=iov_chunks(iov,iovcnt,payload,seams,chunks);
+    sent=(count>0)?send_segments(socket,chunks,count):0;
+    timers_stop(socket);
+    free(chunks);
+    free(seams);
+    return sent;
+}
+
+ssize_t microtcp_send_streams (microtcp_sock_t *socket, const microtcp_stream_buf_t *bufs, size_t count){
+    send_chunk_t *chunks;
+    ssize_t sent;
+    size_t i;
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    for(i = 0; i < count; i++){
+        if(bufs[i].stream>=MICROTCP_MAX_STREAMS){
+            errno=EINVAL;
+            return -1;
+        }
+    }
+    /* What microtcp_send() holds is older data of stream 0 */
+    if(sndbuf_flush(socket)==-1){
+        return -1;
+    }
+    chunks=malloc(count*sizeof(send_chunk_t));
+    if(chunks==NULL){
+        perror("allocating stream buffers");
+        return -1;
+    }
+    for(i = 0; i < count; i++){
+        chunks[i].stream=bufs[i].stream;
+        chunks[i].data=(const uint8_t*)bufs[i].buffer;
+        chunks[i].length=bufs[i].length;
+        chunks[i].eor=0;
+        chunks[i].deadline=0;
+    }
+    sent=send_segments(socket,chunks,count);
+    timers_stop(socket);
+    free(chunks);
+    return sent;
+}
+
+ssize_t microtcp_send_stream (microtcp_sock_t *socket, uint32_t stream, const void *buffer, size_t length){
+    microtcp_stream_buf_t buf;
+    buf.stream=stream;
+    buf.buffer=buffer;
+    buf.length=length;
+    return microtcp_send_streams(socket,&buf,1);
+}
+
+ssize_t microtcp_send_msg (microtcp_sock_t *socket, uint32_t stream, const void *buffer, size_t length, uint32_t lifetime_ms){
+    send_chunk_t chunk;
+    ssize_t sent;
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    if(stream>=MICROTCP_MAX_STREAMS){
+        errno=EINVAL;
+        return -1;
+    }
+    if(length==0){
+        return 0;
+    }
+    if(sndbuf_flush(socket)==-1){
+        return -1;
+    }
+    chunk.stream=stream;
+    chunk.data=(const uint8_t*)buffer;
+    chunk.length=length;
+    chunk.eor=1;
+    chunk.deadline=(lifetime_ms>0)?now_us()+(uint64_t)lifetime_ms*1000:0;
+    sent=send_segments(socket,&chunk,1);
+    timers_stop(socket);
+    if(sent==-1){
+        return -1;
+    }
+    return chunk.abandoned?0:sent;
+}
+
+/* Fills buf from the file, stopping early only at its end */
+static ssize_t file_read (int fd, off_t offset, uint8_t *buf, size_t len){
+    size_t got=0;
+    ssize_t n;
+    while(got<len){
+        n=pread(fd,buf+got,len-got,offset+got);
+        if(n==-1 && errno==EINTR){
+            continue;
+        }
+        if(n==-1){
+            perror("reading file");
+            return -1;
+        }
+        if(n==0){
+            break;
+        }
+        got+=n;
+    }
+    return got;
+}
+
+static int file_write (int fd, off_t offset, const uint8_t *buf, size_t len){
+    size_t done=0;
+    ssize_t n;
+    while(done<len){
+        n=pwrite(fd,buf+done,len-done,offset+done);
+        if(n==-1 && errno==EINTR){
+            continue;
+        }
+        if(n==-1){
+            perror("writing file");
+            return -1;
+        }
+        done+=n;
+    }
+    return 0;
+}
+
+ssize_t microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t length){
+    size_t page=sysconf(_SC_PAGESIZE);
+    struct stat sb;
+    uint8_t *buf=NULL;
+    uint8_t *map;
+    size_t sent=0;
+    size_t window;
+    size_t skew;
+    off_t start;
+    ssize_t n;
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    if(fstat(fd,&sb)==-1){
+        perror("sendfile stat");
+        return -1;
+    }
+    if(S_ISREG(sb.st_mode)){
+        if(offset>=sb.st_size){
+            return 0;
+        }
+        if(length>(size_t)(sb.st_size-offset)){
+            length=sb.st_size-offset;
+        }
+    }
+    /* What microtcp_send() holds goes first */
+    if(sndbuf_flush(socket)==-1){
+        return -1;
+    }
+    while(sent<length){
+        window=(length-sent<MICROTCP_FILE_WINDOW)?length-sent:MICROTCP_FILE_WINDOW;
+        start=offset+sent;
+        skew=start%page;
+        map=S_ISREG(sb.st_mode)?mmap(NULL,window+skew,PROT_READ,MAP_SHARED,fd,start-skew):MAP_FAILED;
+        if(map!=MAP_FAILED){
+            madvise(map,window+skew,MADV_SEQUENTIAL);
+            n=send_data(socket,map+skew,window);
+            munmap(map,window+skew);
+        }else{
+            if(buf==NULL && (buf=malloc(MICROTCP_FILE_WINDOW))==NULL){
+                perror("allocating file buffer");
+                return -1;
+            }
+            n=file_read(fd,start,buf,window);
+            if(n>0){
+                n=send_data(socket,buf,n);
+            }
+        }
+        if(n==-1){
+            free(buf);
+            return -1;
+        }
+        if(n==0){
+            break;
+        }
+        sent+=n;
+    }
+    free(buf);
+    return sent;
+}
+
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int optname, int value){
+    uint8_t *buf;
+    uint8_t *ztx;
+    uint8_t *zrx;
+    microtcp_fec_block_t *blocks;
+    int i;
+    switch(optname){
+    case MICROTCP_NODELAY:
+        socket->nodelay=(value!=0);
+        return socket->nodelay?sndbuf_flush(socket):0;
+    case MICROTCP_CORK:
+        socket->cork=(value!=0);
+        return socket->cork?0:sndbuf_flush(socket);
+    case MICROTCP_FASTOPEN:
+        socket->fastopen=(value!=0);
+        return 0;
+    case MICROTCP_KEEPALIVE:
+        if(value<0){
+            return -1;
+        }
+        socket->keepalive_us=(uint32_t)value*1000;
+        return 0;
+    case MICROTCP_IDLE_TIMEOUT:
+        if(value<0){
+            return -1;
+        }
+        socket->idle_us=(uint32_t)value*1000;
+        return 0;
+    case MICROTCP_TRACE:
+        if(value<0){
+            return -1;
+        }
+        free(socket->trace.events);
+        socket->trace.events=NULL;
+        socket->trace.mask=0;
+        socket->trace.head=0;
+        if(value>0){
+            size_t len=1;
+            while(len<(size_t)value){
+                len<<=1;
             }
-            socket->seq_number+=MAX_PAYLOAD_SIZE;
-            free(send_buf);
+            socket->trace.events=calloc(len,sizeof(microtcp_trace_event_t));
+            if(socket->trace.events==NULL){
+                perror("allocating trace ring");
+                return -1;
+            }
+            socket->trace.mask=len-1;
         }
-    /* Check if there is a semi - filled chunk
-    */ 
-        int temp_chunks=chunks;
-        if(bytes_to_send % (MAX_PAYLOAD_SIZE)!=0){
-            #ifdef  DEBUG
-            printf("Inside semi-filled chunk\n");
-            #endif
-            chunks++;
-            header=create_header(socket->seq_number+bytes_to_send % MAX_PAYLOAD_SIZE,ACK,bytes_to_send % MAX_PAYLOAD_SIZE,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-            send_buf=calloc(1,sizeof(microtcp_header_t)+bytes_to_send % MAX_PAYLOAD_SIZE);
-            memcpy(send_buf,&header,sizeof(microtcp_header_t));
-            memcpy(send_buf+sizeof(microtcp_header_t),buffer+data_sent+i*MAX_PAYLOAD_SIZE,bytes_to_send % MAX_PAYLOAD_SIZE);
-            header.checksum=htonl(crc32((uint8_t*)send_buf,sizeof(microtcp_header_t)+bytes_to_send %MAX_PAYLOAD_SIZE));
-            memcpy(send_buf,&header,sizeof(microtcp_header_t));
-            //print
-            #ifdef  DEBUG
-            printf("Sending packet with sequence number: %lu, i: %d, chunks: %d\n",socket->seq_number+bytes_to_send % MAX_PAYLOAD_SIZE,i,chunks);
-            #endif  //DEBUG 
-
-            if(sendto(socket->sd,send_buf,sizeof(microtcp_header_t)+bytes_to_send % MAX_PAYLOAD_SIZE,flags,(struct sockaddr*)socket->address,socket->address_len)==-1){
-                perror("sending packet");
-                exit(EXIT_FAILURE);
-            }
-            socket->seq_number+=bytes_to_send % MAX_PAYLOAD_SIZE;
-            free(send_buf);
-        }
-    /* Get the ACKs */
-        uint32_t prev_ack=-1;
-        int count=0;
-        int ack_check=1;
-        for(i = 0; i < chunks;i++){
-            status=recvfrom(socket->sd,(void*)recv_buf,MICROTCP_RECVBUF_LEN,flags,(struct sockaddr*)socket->address,&socket->address_len);
-            if(status==-1){
-                socket->ssthresh=socket->cwnd/2;
-                socket->cwnd=(MAX_PAYLOAD_SIZE<socket->ssthresh)?MAX_PAYLOAD_SIZE:socket->ssthresh;
-                if(i!=0){
-                  #ifdef  DEBUG
-                  printf("Inside Time Out\n");
-                  #endif
-                    //fast retransmit
-                    data_sent=data_sent+(header.ack_number-starting_seq);
-                    remaining=remaining-(header.ack_number-starting_seq);
-                    socket->seq_number=header.ack_number;
-                    ack_check=0;
+        return 0;
+    case MICROTCP_FEC:
+        if(value<0 || value>MICROTCP_FEC_MAX_BLOCK){
+            return -1;
+        }
+        if(value>0 && socket->fec_parity==NULL){
+            /* The socket only takes the buffers once all of them are there */
+            buf=calloc(1,MICROTCP_MAX_MSS);
+            blocks=calloc(MICROTCP_FEC_BLOCKS,sizeof(microtcp_fec_block_t));
+            for(i = 0; i < MICROTCP_FEC_BLOCKS && blocks!=NULL; i++){
+                if((blocks[i].acc=calloc(1,MICROTCP_MAX_MSS))==NULL){
                     break;
-                }else{
-                  socket->seq_number=starting_seq;
-                  ack_check=0;
-                  break;
                 }
             }
-            memcpy(&header,recv_buf,sizeof(microtcp_header_t));
-            microtcp_header_t temp=reverse(header);
-            uint32_t checksum=ntohl(header.checksum);
-            int size=sizeof(microtcp_header_t)+temp.data_len;
-            header.checksum=0;
-            memcpy(recv_buf,&header,sizeof(microtcp_header_t));
-            if((uint32_t)checksum != crc32((const uint8_t*)&recv_buf,size)){
-                perror("checksum error 7");
-                exit(EXIT_FAILURE);
-            }
-            header=reverse(header);
-            socket->curr_win_size=header.window;
-            //print
-            #ifdef  DEBUG
-            printf("Received ACK packet with ack number: %u\n",header.ack_number);
-            #endif
-            if(header.ack_number==prev_ack){
-                ack_check=0;
-                count++;
-            }else{
-                prev_ack=header.ack_number;
-                count=0;
-                uint32_t calculated_ack;
-                if(i!=temp_chunks){
-                  //check if ack received is what we sended
-                  calculated_ack=(i+1)*(MAX_PAYLOAD_SIZE)+starting_seq;
-
-                }else{
-                  calculated_ack=temp_chunks*(MAX_PAYLOAD_SIZE) + (bytes_to_send % (MAX_PAYLOAD_SIZE))+starting_seq;
-                }
-                if(header.ack_number!=calculated_ack){
-                  //print both
-                  printf("Wrong ->Expected Acknowledgement Number : %d\n",calculated_ack);
-                }
-                //slow start
-                if(socket->cwnd<=socket->ssthresh){
-                  cwnd_inc=1;
-                  socket->cwnd+=(MAX_PAYLOAD_SIZE);
+            if(buf==NULL || blocks==NULL || i<MICROTCP_FEC_BLOCKS){
+                perror("allocating FEC buffers");
+                while(blocks!=NULL && i-- > 0){
+                    free(blocks[i].acc);
                 }
+                free(blocks);
+                free(buf);
+                return -1;
             }
-            if(count==3){
-              //fast retransmit
-              data_sent=data_sent+(header.ack_number-starting_seq);
-              remaining=remaining-(header.ack_number-starting_seq);
-              socket->seq_number=header.ack_number;
-              ack_check=0;
-              socket->ssthresh=socket->cwnd/2;
-              socket->cwnd/2+1;
-              break;
+            socket->fec_parity=buf;
+            socket->fec_blocks=blocks;
+        }
+        socket->fec_k=value;
+        return 0;
+    case MICROTCP_COMPRESS:
+        if(value && socket->ztx==NULL){
+            ztx=malloc(MICROTCP_MAX_MSS);
+            zrx=malloc(LZ_MAX_INPUT);
+            if(ztx==NULL || zrx==NULL || (buf=realloc(socket->sndbuf,LZ_MAX_INPUT))==NULL){
+                perror("allocating compression buffers");
+                free(ztx);
+                free(zrx);
+                return -1;
             }
-            
+            socket->sndbuf=buf;
+            socket->ztx=ztx;
+            socket->zrx=zrx;
         }
-        if(socket->curr_win_size==0){
-          //send a packet without payload
-          header=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-          header.checksum=htonl(crc32((uint8_t*)&header,sizeof(microtcp_header_t)));
-          #ifdef  DEBUG
-          printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-          #endif
-          if(sendto(socket->sd,(void*)&header,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-              perror("sending ACK packet");
-              exit(EXIT_FAILURE);
-          }
-          
-          while(recvfrom(socket->sd,(void*)recv_buf,MICROTCP_RECVBUF_LEN,flags,(struct sockaddr*)socket->address,&socket->address_len)==-1){
-              header=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-              header.checksum=htonl(crc32((uint8_t*)&header,sizeof(microtcp_header_t)));
-              #ifdef  DEBUG
-              printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-              #endif
-              if(sendto(socket->sd,(void*)&header,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-                  perror("sending ACK packet");
-                  exit(EXIT_FAILURE);
-              }
-          }
-          //copy header of recvbuf to header
-          memcpy(&header,recv_buf,sizeof(microtcp_header_t));
-          microtcp_header_t temp=reverse(header);
-          uint32_t checksum=ntohl(header.checksum);
-          int size=sizeof(microtcp_header_t)+temp.data_len;
-          header.checksum=0;
-          memcpy(recv_buf,&header,sizeof(microtcp_header_t));
-          if(checksum != crc32((const uint8_t*)&recv_buf,size)){
-              perror("checksum error 8");
-              exit(EXIT_FAILURE);
-          }
-          header=reverse(header);
-          socket->curr_win_size=header.window;
+        socket->compress=(value!=0);
+        return 0;
+    case MICROTCP_PLPMTUD:
+        if(!value){
+            socket->plpmtu_state=PLPMTU_DISABLED;
+            socket->probe_size=0;
+        }else if(socket->plpmtu_state==PLPMTU_DISABLED){
+            socket->plpmtu_state=(socket->max_mss>socket->mss)?PLPMTU_SEARCHING:PLPMTU_SEARCH_COMPLETE;
         }
-        /* Retransmissions */
-        /* Update window */
-        /* Update congestion control */
-        if(ack_check){
-          remaining -= bytes_to_send;
-          data_sent += bytes_to_send;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int
+microtcp_get_stats (const microtcp_sock_t *socket, microtcp_stats_t *stats){
+    if(socket==NULL || stats==NULL){
+        return -1;
+    }
+    stats->packets_send=socket->packets_send;
+    stats->packets_received=socket->packets_received;
+    stats->packets_lost=socket->packets_lost;
+    stats->bytes_send=socket->bytes_send;
+    stats->bytes_received=socket->bytes_received;
+    stats->bytes_lost=socket->bytes_lost;
+    stats->retransmits=socket->retransmits;
+    stats->timeouts=socket->timeouts;
+    stats->spurious_timeouts=socket->spurious_timeouts;
+    stats->dup_acks=socket->dup_acks;
+    stats->fec_repairs=socket->fec_repairs;
+    stats->bytes_saved=socket->bytes_saved;
+    stats->rtt_min_us=socket->rtt_hist.min;
+    stats->rtt_avg_us=histogram_mean(&socket->rtt_hist);
+    stats->rtt_p99_us=histogram_percentile(&socket->rtt_hist,99.0);
+    stats->srtt_us=socket->srtt_us;
+    stats->cwnd=socket->cwnd;
+    stats->ssthresh=socket->ssthresh;
+    stats->peer_win_size=socket->curr_win_size;
+    stats->mss=socket->mss;
+    return 0;
+}
+
+size_t
+microtcp_trace_read (const microtcp_sock_t *socket, uint64_t *cursor,
+                     microtcp_trace_event_t *events, size_t max){
+    const microtcp_trace_t *t=&socket->trace;
+    uint64_t head;
+    uint64_t first;
+    size_t n=0;
+    size_t i;
+    if(t->events==NULL){
+        return 0;
+    }
+    head=__atomic_load_n(&t->head,__ATOMIC_ACQUIRE);
+    first=*cursor;
+    if(head-first>t->mask+1){
+        first=head-(t->mask+1);
+    }
+    for(;first+n<head && n<max;n++){
+        events[n]=t->events[(first+n)&t->mask];
+    }
+    /* The writer may have lapped us while copying, drop what it overwrote */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head=__atomic_load_n(&t->head,__ATOMIC_RELAXED);
+    if(head>t->mask && first<=head-(t->mask+1)){
+        i=head-(t->mask+1)-first+1;
+        if(i>n){
+            i=n;
         }
+        memmove(events,events+i,(n-i)*sizeof(microtcp_trace_event_t));
+        n-=i;
+        first+=i;
+    }
+    *cursor=first+n;
+    return n;
+}
 
-        if(!cwnd_inc&&socket->cwnd>socket->ssthresh){
-          socket->cwnd+=(MAX_PAYLOAD_SIZE);
+int
+microtcp_trace_save (const microtcp_sock_t *socket, const char *path){
+    microtcp_trace_event_t events[256];
+    uint64_t cursor=0;
+    uint32_t magic=MICROTCP_TRACE_MAGIC;
+    size_t n;
+    FILE *fp;
+    fp=fopen(path,"wb");
+    if(fp==NULL){
+        perror("opening trace file");
+        return -1;
+    }
+    if(fwrite(&magic,sizeof(magic),1,fp)!=1){
+        perror("writing trace file");
+        fclose(fp);
+        return -1;
+    }
+    while((n=microtcp_trace_read(socket,&cursor,events,256))>0){
+        if(fwrite(events,sizeof(microtcp_trace_event_t),n,fp)!=n){
+            perror("writing trace file");
+            fclose(fp);
+            return -1;
         }
-        cwnd_inc=0;
-     }
-    return data_sent;
+    }
+    return fclose(fp);
 }
 
-ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags){
+/* In-order bytes of a stream waiting for the application */
+static size_t *stream_fill (microtcp_sock_t *socket, microtcp_stream_t *st){
+    return (st==socket->streams)?&socket->buf_fill_level:&st->fill;
+}
+
+/* Receive buffer space of a stream, the window advertised for it */
+static uint16_t stream_window (microtcp_sock_t *socket, uint32_t stream){
+    return MICROTCP_RECVBUF_LEN-*stream_fill(socket,&socket->streams[stream]);
+}
+
+/*
+ * Sends a cumulative ACK echoing the timestamp of the last in-order segment.
+ * It carries the window of the stream of the last segment, or of the stream
+ * the peer probed.
+ */
+static void send_ack (microtcp_sock_t *socket){
+    microtcp_header_t packet;
+    socket->streams[socket->ack_stream].adv_win=stream_window(socket,socket->ack_stream);
+    packet=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->streams[socket->ack_stream].adv_win);
+    packet.future_use0=htonl(socket->ts_sack);
+    packet.future_use1=htonl(socket->ts_recent);
+    packet.future_use2=htonl(socket->ack_stream);
+    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
+    #ifdef  DEBUG
+    printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
+    #endif
+    socket->ack_pending=0;
+    socket->ts_sack=0;
+    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
+        perror("sending ACK packet");
+        return;
+    }
+    socket->packets_send++;
+}
+
+/*
+ * Tells the peer a stream has room again, once reading has opened its window
+ * from below a segment, or half the buffer, to at least that. Smaller
+ * openings are left for the next ACK so the peer does not send slivers
+ * (RFC 1122 receiver SWS avoidance).
+ */
+static void window_update (microtcp_sock_t *socket, uint32_t stream){
+    size_t threshold=(SEGMENT_PAYLOAD(socket)<MICROTCP_RECVBUF_LEN/2)?SEGMENT_PAYLOAD(socket):MICROTCP_RECVBUF_LEN/2;
+    if(socket->state!=ESTABLISHED || socket->streams[stream].adv_win>=threshold
+       || stream_window(socket,stream)<threshold){
+        return;
+    }
+    #ifdef  DEBUG
+    printf("Sending window update for stream %u\n",stream);
+    #endif
+    socket->ack_stream=stream;
+    send_ack(socket);
+}
+
+static void send_keepalive (microtcp_sock_t *socket, uint32_t seq){
+    microtcp_header_t packet;
+    packet=create_header(seq,ACK|PROBE,0,socket->ack_number,recv_window(socket));
+    packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
+    if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
+        perror("sending keepalive packet");
+        return;
+    }
+    socket->packets_send++;
+}
+
+/*
+ * A keepalive is a probe ACK without a probe size for the byte before the
+ * one the peer expects next. It is answered with our current sequence
+ * number, and the answer is not answered. Returns 1 for either of them.
+ */
+static int keepalive_input (microtcp_sock_t *socket, const microtcp_header_t *packet){
+    if(packet->control!=(ACK|PROBE) || packet->data_len!=0 || packet->future_use2!=0){
+        return 0;
+    }
+    if(packet->seq_number==(uint32_t)(socket->ack_number-1)){
+        send_keepalive(socket,socket->seq_number);
+    }
+    return 1;
+}
+
+/*
+ * Adds [start, end) to a sorted set of disjoint ranges that lie after
+ * *next, merging it with its neighbours. A range reaching *next moves it
+ * past the range and past every range the move reaches in turn.
+ * Returns -1 if the range is new and the set already holds max ranges.
+ */
+static int range_add (microtcp_range_t *r, size_t *count, size_t max, uint32_t *next, uint32_t start, uint32_t end){
+    size_t i;
+    if(!seq_before(*next,start)){
+        if(seq_before(*next,end)){
+            *next=end;
+        }
+        while(*count>0 && !seq_before(*next,r[0].start)){
+            if(seq_before(*next,r[0].end)){
+                *next=r[0].end;
+            }
+            memmove(r,r+1,--(*count)*sizeof(microtcp_range_t));
+        }
+        return 0;
+    }
+    for(i = 0; i < *count && seq_before(r[i].end,start); i++);
+    if(i<*count && !seq_before(end,r[i].start)){
+        if(seq_before(start,r[i].start)){
+            r[i].start=start;
+        }
+        if(seq_before(r[i].end,end)){
+            r[i].end=end;
+        }
+        while(i+1<*count && !seq_before(r[i].end,r[i+1].start)){
+            if(seq_before(r[i].end,r[i+1].end)){
+                r[i].end=r[i+1].end;
+            }
+            (*count)--;
+            memmove(r+i+1,r+i+2,(*count-i-1)*sizeof(microtcp_range_t));
+        }
+        return 0;
+    }
+    if(*count==max){
+        return -1;
+    }
+    memmove(r+i+1,r+i,(*count-i)*sizeof(microtcp_range_t));
+    r[i].start=start;
+    r[i].end=end;
+    (*count)++;
+    return 0;
+}
+
+/* Whether [start, end) lies within one of the ranges */
+static int range_covered (const microtcp_range_t *r, size_t count, uint32_t start, uint32_t end){
+    size_t i;
+    for(i = 0; i < count; i++){
+        if(!seq_before(start,r[i].start) && !seq_before(r[i].end,end)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The decoding state of an FEC block, taking over the slot of an older
+ * block. NULL if FEC is off or the block is older than the one in its slot.
+ */
+static microtcp_fec_block_t *fec_slot (microtcp_sock_t *socket, uint32_t block){
+    microtcp_fec_block_t *b;
+    if(socket->fec_blocks==NULL || block==0){
+        return NULL;
+    }
+    b=&socket->fec_blocks[block%MICROTCP_FEC_BLOCKS];
+    if(b->block!=block){
+        if(b->block!=0 && ((block-b->block)&0xffff)>=0x8000){
+            return NULL;
+        }
+        memset(b->acc,0,b->len);
+        b->block=block;
+        b->count=0;
+        b->received=0;
+        b->done=0;
+        b->seq=0;
+        b->offset=0;
+        b->meta=0;
+        b->len=0;
+    }
+    return b;
+}
+
+static void fec_accumulate (microtcp_fec_block_t *b, const microtcp_header_t *packet, uint32_t meta,
+                            const uint8_t *data, uint32_t len){
+    fec_xor(b->acc,data,len);
+    if(len>b->len){
+        b->len=len;
+    }
+    b->seq^=packet->seq_number;
+    b->offset^=packet->future_use1;
+    b->meta^=meta;
+}
+
+/* Adds a data segment received for the first time to its FEC block, with its payload as received */
+static void fec_add (microtcp_sock_t *socket, uint32_t block, const microtcp_header_t *packet, uint32_t stream,
+                     const uint8_t *data, uint32_t len){
+    microtcp_fec_block_t *b=fec_slot(socket,block);
+    if(b==NULL || b->done){
+        return;
+    }
+    fec_accumulate(b,packet,fec_meta(len,stream,packet->control&(EOR|COMPRESSED)),data,len);
+    if(++b->received==b->count){
+        b->done=1;
+    }
+}
+
+/*
+ * Handles a parity segment. If its block misses exactly one segment, the
+ * segment is rebuilt in place of the parity, header and payload, and 1 is
+ * returned. Returns 0 if there is nothing to rebuild or too much is missing.
+ */
+static int fec_input (microtcp_sock_t *socket, microtcp_header_t *packet, uint8_t *payload){
+    microtcp_fec_block_t *b=fec_slot(socket,packet->future_use2>>16);
+    uint32_t len;
+    uint32_t stream;
+    if(b==NULL || b->done || b->count!=0 || packet->data_len>MICROTCP_MAX_MSS){
+        return 0;
+    }
+    fec_accumulate(b,packet,packet->future_use0,payload,packet->data_len);
+    b->count=packet->future_use2&0xffff;
+    if(b->received+1!=b->count){
+        b->done=(b->received>=b->count);
+        return 0;
+    }
+    b->done=1;
+    len=b->meta>>16;
+    stream=b->meta&0xff;
+    if(len==0 || len>b->len || stream>=MICROTCP_MAX_STREAMS){
+        return 0;
+    }
+    #ifdef  DEBUG
+    printf("Rebuilt the segment with sequence number %u from FEC block %u\n",b->seq,b->block);
+    #endif
+    memcpy(payload,b->acc,len);
+    packet->seq_number=b->seq;
+    packet->control=ACK|(((b->meta>>8)<<5)&(EOR|COMPRESSED));
+    packet->data_len=len;
+    packet->ack_number=socket->seq_number;
+    packet->future_use0=0;
+    packet->future_use1=b->offset;
+    packet->future_use2=b->block<<16|stream;
+    socket->fec_repairs++;
+    return 1;
+}
+
+/* Remembers where a message ends, returns -1 if too many are waiting to be read */
+static int record_add (microtcp_stream_t *st, uint32_t end){
+    size_t i;
+    if(st->records==NULL && (st->records=malloc(2*MICROTCP_RETRANSQ_LEN*sizeof(uint32_t)))==NULL){
+        return -1;
+    }
+    for(i = 0; i < st->record_count && seq_before(st->records[i],end); i++);
+    if(i<st->record_count && st->records[i]==end){
+        return 0;
+    }
+    if(st->record_count==2*MICROTCP_RETRANSQ_LEN){
+        return -1;
+    }
+    memmove(st->records+i+1,st->records+i,(st->record_count-i)*sizeof(uint32_t));
+    st->records[i]=end;
+    st->record_count++;
+    return 0;
+}
+
+/*
+ * Places the payload of a data segment in its stream. Data after a gap is
+ * written at its place in the receive buffer right away, and becomes
+ * readable together with the data that fills the gap. Returns -1 if the
+ * payload is beyond the window of the stream.
+ */
+static int stream_input (microtcp_sock_t *socket, uint32_t stream, uint32_t offset, const uint8_t *data, uint32_t len, int eor){
+    microtcp_stream_t *st=&socket->streams[stream];
+    size_t *fill=stream_fill(socket,st);
+    uint32_t next=st->recv_offset;
+    uint32_t ahead;
+    if(seq_before(offset,next)){
+        if(!seq_before(next,offset+len)){
+            /* Delivered already */
+            return 0;
+        }
+        data+=next-offset;
+        len-=next-offset;
+        offset=next;
+    }
+    ahead=offset-next;
+    if((size_t)ahead+len>MICROTCP_RECVBUF_LEN-*fill){
+        return -1;
+    }
+    if(st->recvbuf==NULL && (st->recvbuf=malloc(MICROTCP_RECVBUF_LEN))==NULL){
+        return -1;
+    }
+    if(st->ranges==NULL && (st->ranges=malloc(2*MICROTCP_RETRANSQ_LEN*sizeof(microtcp_range_t)))==NULL){
+        return -1;
+    }
+    if(eor && record_add(st,offset+len)==-1){
+        return -1;
+    }
+    if(range_add(st->ranges,&st->range_count,2*MICROTCP_RETRANSQ_LEN,&next,offset,offset+len)==-1){
+        return -1;
+    }
+    /* The payload may have been received in place, or next to it */
+    if(st->recvbuf+*fill+ahead!=data){
+        memmove(st->recvbuf+*fill+ahead,data,len);
+    }
+    *fill+=next-st->recv_offset;
+    st->recv_offset=next;
+    return 0;
+}
+
+/*
+ * Moves in-order data of a stream to the application, keeping what does
+ * not fit for the next call. A NULL buffer discards the data.
+ */
+static size_t stream_drain (microtcp_sock_t *socket, uint32_t stream, uint8_t *buffer, size_t length){
+    microtcp_stream_t *st=&socket->streams[stream];
+    size_t *fill=stream_fill(socket,st);
+    size_t n=(*fill<length)?*fill:length;
+    size_t ahead=0;
+    if(n==0){
+        return 0;
+    }
+    if(st->range_count>0){
+        /* Data after the gap moves along */
+        ahead=st->ranges[st->range_count-1].end-st->recv_offset;
+    }
+    if(buffer!=NULL){
+        memcpy(buffer,st->recvbuf,n);
+    }
+    memmove(st->recvbuf,st->recvbuf+n,*fill-n+ahead);
+    *fill-=n;
+    return n;
+}
+
+/*
+ * Moves the first complete message of a stream to the application, the
+ * part that does not fit is dropped. Returns 0 if no message is complete.
+ */
+static size_t record_drain (microtcp_sock_t *socket, uint32_t stream, uint8_t *buffer, size_t length){
+    microtcp_stream_t *st=&socket->streams[stream];
+    uint32_t start=st->recv_offset-*stream_fill(socket,st);
+    size_t n;
+    size_t copied;
+    if(st->record_count==0 || seq_before(st->recv_offset,st->records[0])){
+        return 0;
+    }
+    n=st->records[0]-start;
+    memmove(st->records,st->records+1,--st->record_count*sizeof(uint32_t));
+    copied=stream_drain(socket,stream,buffer,(n<length)?n:length);
+    stream_drain(socket,stream,NULL,n-copied);
+    return copied;
+}
+
+/*
+ * Handles a SKIP segment: the sender abandoned the message of a stream that
+ * ends at offset end, and everything unacknowledged before sequence number
+ * seq. Whatever arrived of the message is dropped.
+ */
+static void skip_input (microtcp_sock_t *socket, uint32_t seq, uint32_t stream, uint32_t end){
+    microtcp_stream_t *st=&socket->streams[stream];
+    size_t *fill=stream_fill(socket,st);
+    uint32_t ack=socket->ack_number;
+    uint32_t start=st->recv_offset-*fill;
+    size_t i;
+    if(seq_before(ack,seq)){
+        range_add(socket->rcv_ranges,&socket->rcv_range_count,MICROTCP_RETRANSQ_LEN,&ack,ack,seq);
+        socket->ack_number=ack;
+    }
+    if(!seq_before(st->recv_offset,end)){
+        /* It arrived whole after all */
+        return;
+    }
+    /* The message starts where the last complete one ends */
+    for(i = 0; i < st->record_count && !seq_before(st->recv_offset,st->records[i]); i++){
+        if(seq_before(start,st->records[i])){
+            start=st->records[i];
+        }
+    }
+    st->record_count=i;
+    *fill-=st->recv_offset-start;
+    st->range_count=0;
+    st->recv_offset=end;
+}
+
+/* Arms the timers that may interrupt a wait for data */
+static void recv_timers (microtcp_sock_t *socket){
+    if(socket->ack_pending>0){
+        timer_arm(socket,TIMER_DELACK,socket->ack_pending_us+MICROTCP_DELACK_US);
+    }else{
+        timer_cancel(socket,TIMER_DELACK);
+    }
+    if(socket->keepalive_us>0){
+        timer_arm(socket,TIMER_KEEPALIVE,socket->last_recv_us+(uint64_t)(socket->keepalive_probes+1)*socket->keepalive_us);
+    }
+    if(socket->idle_us>0){
+        timer_arm(socket,TIMER_IDLE,socket->last_recv_us+socket->idle_us);
+    }
+}
+
+/* What recv_segments() waits for */
+#define RECV_STREAM 0           /* Data of *stream */
+#define RECV_ANY 1              /* Data of the first stream to get some, stored in *stream */
+#define RECV_MSG 2              /* The first message to complete, its stream stored in *stream */
+#define RECV_ZC 3               /* Data of stream 0 left in recvbuf past the bytes on loan */
+
+static ssize_t recv_segments (microtcp_sock_t *socket, uint32_t *stream, int mode, uint8_t *buffer, size_t length, size_t copied, int flags){
 
     microtcp_header_t packet;
-    uint32_t checksum;
+    uint32_t ack;
+    uint32_t seg_stream;
+    microtcp_stream_t *st;
+    const uint8_t *wire;
+    const uint8_t *data;
+    uint8_t *payload;
+    uint32_t wire_len;
+    ssize_t zlen;
+    size_t placed;
+    int waitall=(mode<=RECV_ANY && (flags&MSG_WAITALL));
+    int in_order;
+    int gap;
     int status;
-    int recvbuf_size=0;
-    int start_buf_level=socket->buf_fill_level;
-    int size;
-    struct timeval timeout;
+    struct iovec iov[2];
     char recv_buf[MICROTCP_RECVBUF_LEN+sizeof(microtcp_header_t)];
-    timeout.tv_sec = 0;
-    timeout.tv_usec = MICROTCP_ACK_TIMEOUT_US;
-    if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, & timeout ,sizeof( struct timeval)) < 0){
-        perror("setsockopt");
+    flags&=~MSG_WAITALL;
+    /*
+     * Keep receiving while another base size segment fits in the caller's buffer,
+     * but once there is data only take what has already arrived, unless the
+     * caller waits for all of it
+     */
+    while(copied==0 || (mode!=RECV_MSG && (waitall?copied<length:length-copied>=MAX_PAYLOAD_SIZE))){
+      recv_timers(socket);
+      /*
+       * With room for any segment, the payload lands in the caller's buffer
+       * and in-order data of the stream read stays there without a copy
+       */
+      payload=(uint8_t*)recv_buf+sizeof(microtcp_header_t);
+      iov[1].iov_len=MICROTCP_RECVBUF_LEN;
+      if(mode<=RECV_ANY && length-copied>=MICROTCP_MAX_MSS){
+          payload=buffer+copied;
+          iov[1].iov_len=(length-copied<MICROTCP_RECVBUF_LEN)?length-copied:MICROTCP_RECVBUF_LEN;
+      }else if(mode==RECV_ZC && socket->streams[0].range_count==0
+               && MICROTCP_RECVBUF_LEN-socket->buf_fill_level>=MICROTCP_MAX_MSS){
+          /* Where stream 0 continues, so its next segment is loaned without a copy */
+          payload=socket->recvbuf+socket->buf_fill_level;
+          iov[1].iov_len=MICROTCP_RECVBUF_LEN-socket->buf_fill_level;
       }
-    if(socket->state==CLOSING_BY_PEER){
-      return -1;
-    }
-    while(1){
-      status=recvfrom(socket->sd,recv_buf,(MAX_PAYLOAD_SIZE)+sizeof(microtcp_header_t),flags,(struct sockaddr*)socket->address,&socket->address_len);
+      iov[0].iov_base=recv_buf;
+      iov[0].iov_len=sizeof(microtcp_header_t);
+      iov[1].iov_base=payload;
+      status=timed_recvmsg(socket,iov,2,(copied>0 && !waitall)?flags|MSG_DONTWAIT:flags,(struct sockaddr*)socket->address,&socket->address_len);
       if(status==-1){
+          if(copied>0 && (!waitall || (errno!=EAGAIN && errno!=EWOULDBLOCK))){
+              break;
+          }
+          if(errno==EAGAIN||errno==EWOULDBLOCK){
+              /* Nothing received yet, the sender will retransmit */
+              if(socket->timers_fired&(1U<<TIMER_IDLE)){
+                  errno=ETIMEDOUT;
+                  return (copied>0)?(ssize_t)copied:-1;
+              }
+              if(socket->timers_fired&(1U<<TIMER_KEEPALIVE)){
+                  if(socket->keepalive_probes==MICROTCP_KEEPALIVE_PROBES){
+                      errno=ETIMEDOUT;
+                      return (copied>0)?(ssize_t)copied:-1;
+                  }
+                  socket->keepalive_probes++;
+                  send_keepalive(socket,socket->seq_number-1);
+              }
+              if(socket->timers_fired&(1U<<TIMER_DELACK)){
+                  send_ack(socket);
+              }
+              continue;
+          }
+          if(errno==EINTR){
+              /* Interrupted by a signal, let the caller decide */
+              return -1;
+          }
           perror("receiving packet");
           return -EXIT_FAILURE;
       }
-      memcpy(&packet,recv_buf,sizeof(microtcp_header_t));
-      checksum=ntohl(packet.checksum);
-      microtcp_header_t temp=reverse(packet);
-      size=sizeof(microtcp_header_t)+temp.data_len;
-      packet.checksum=0;
-      memcpy(recv_buf,&packet,sizeof(microtcp_header_t));
-       if(checksum != crc32((const uint8_t*)recv_buf,size)){
+      if(parse_segment_at((const uint8_t*)recv_buf,payload,status,&packet)==-1){
            perror("checksum error 9");
            continue;
       }
-      packet=reverse(packet);
-      if(packet.control==FINACK&&socket->fun==SERVER){
-          memcpy(buffer,socket->recvbuf+start_buf_level,socket->buf_fill_level-start_buf_level);
+      socket->packets_received++;
+      socket->last_recv_us=now_us();
+      socket->keepalive_probes=0;
+      if(packet.control==FINACK){
           #ifdef  DEBUG
           printf("Received FINACK packet with sequence number: %u\n",packet.seq_number);
           #endif
+          if(packet.seq_number!=socket->ack_number){
+              /* Data before the FIN is missing */
+              send_ack(socket);
+              continue;
+          }
           socket->state=CLOSING_BY_PEER;
           socket->ack_number=packet.seq_number+1;
-          return socket->buf_fill_level-start_buf_level;
+          /* Acknowledged right away, the peer stops retransmitting it before we close */
+          send_ack(socket);
+          /* As on the next call, -1 tells the caller the peer has closed */
+          return (copied>0)?(ssize_t)copied:-1;
+      }
+      if(packet.control==SYNACK){
+          /* Our handshake ACK was lost */
+          send_ack(socket);
+          continue;
+      }
+      if(keepalive_input(socket,&packet)){
+          continue;
+      }
+      if(packet.control==(ACK|SKIP)){
+          if(packet.future_use2<MICROTCP_MAX_STREAMS){
+              if(socket->ack_pending==0 && seq_before(socket->ack_number,packet.seq_number)){
+                  /* Echo the skip itself, not the last data segment, the sender samples its RTT from it */
+                  socket->ts_recent=packet.future_use0;
+              }
+              skip_input(socket,packet.seq_number,packet.future_use2,packet.future_use1);
+              socket->ack_stream=packet.future_use2;
+          }
+          send_ack(socket);
+          continue;
+      }
+      if(packet.control==(ACK|PROBE)){
+          if(packet.data_len>0){
+              plpmtu_reply(socket,status);
+          }else{
+              plpmtu_probe_acked(socket,packet.future_use2);
+          }
+          continue;
       }
-      if(packet.control==ACK){
+      if(packet.control==(ACK|FEC)){
+          /* A parity segment, it stands for the segment of its block it rebuilds */
+          if(fec_input(socket,&packet,payload)==0){
+              continue;
+          }
+      }
+      if((packet.control&~(EOR|COMPRESSED))==ACK){
          #ifdef  DEBUG
           printf("Received ACK packet with sequence number: %u and ack_number: %u\n",packet.seq_number,packet.ack_number);
           #endif
-          //window-x
-          if(packet.seq_number!=socket->ack_number+packet.data_len){
+          if(packet.data_len==0){
+              /* A zero window probe, answered right away with the window of the probed stream */
+              if(packet.future_use2<MICROTCP_MAX_STREAMS){
+                  socket->ack_stream=packet.future_use2;
+              }
+              send_ack(socket);
+              continue;
+          }
+          wire=payload;
+          wire_len=packet.data_len;
+          data=wire;
+          if(packet.control&COMPRESSED){
+              /* From here on the segment is handled as the data it carries */
+              zlen=(socket->zrx!=NULL)?lz_decompress(wire,wire_len,socket->zrx,LZ_MAX_INPUT):-1;
+              if(zlen<=0){
+                  send_ack(socket);
+                  continue;
+              }
+              data=socket->zrx;
+              packet.data_len=zlen;
+          }
+          /*
+           * Segments after a gap are kept, only their own stream waits
+           * for the gap. A segment the stream has no room for is dropped.
+           */
+          seg_stream=packet.future_use2&0xffff;
+          if(packet.ack_number!=socket->seq_number || seg_stream>=MICROTCP_MAX_STREAMS){
               //send DUP ACK
-              packet=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-              packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-              #ifdef  DEBUG
-              printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-              #endif
-              if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-                  perror("sending ACK packet");
-                  exit(EXIT_FAILURE);
+              send_ack(socket);
+              continue;
+          }
+          /*
+           * The next bytes of the stream read, with nothing buffered before
+           * them, go straight to the caller once the segment is accounted
+           */
+          st=&socket->streams[seg_stream];
+          placed=0;
+          if(mode<=RECV_ANY && (seg_stream==*stream || (mode==RECV_ANY && copied==0))
+             && !(packet.control&EOR) && packet.future_use1==st->recv_offset
+             && *stream_fill(socket,st)==0 && st->range_count==0 && packet.data_len<=length-copied){
+              st->recv_offset+=packet.data_len;
+              placed=packet.data_len;
+          }else if(stream_input(socket,seg_stream,packet.future_use1,data,packet.data_len,packet.control&EOR)==-1){
+              send_ack(socket);
+              continue;
+          }
+          socket->ack_stream=seg_stream;
+          ack=socket->ack_number;
+          if(!seq_before(ack,packet.seq_number)){
+              /* A retransmission of a segment we have, its ACK was lost */
+              send_ack(socket);
+          }else{
+              if(!range_covered(socket->rcv_ranges,socket->rcv_range_count,packet.seq_number-packet.data_len,packet.seq_number)){
+                  fec_add(socket,packet.future_use2>>16,&packet,seg_stream,wire,wire_len);
+              }
+              in_order=!seq_before(ack,packet.seq_number-packet.data_len);
+              gap=!in_order || socket->rcv_range_count>0;
+              range_add(socket->rcv_ranges,&socket->rcv_range_count,MICROTCP_RETRANSQ_LEN,&ack,packet.seq_number-packet.data_len,packet.seq_number);
+              socket->ack_number=ack;
+              socket->bytes_received+=packet.data_len;
+              trace_event(socket,TRACE_RECV,packet.seq_number,packet.data_len);
+              if(in_order && socket->ack_pending==0){
+                  /* The ACK echoes the timestamp of the first segment it covers (RFC 7323) */
+                  socket->ts_recent=packet.future_use0;
+                  socket->ack_pending_us=socket->last_recv_us;
+              }else if(!in_order){
+                  /* The duplicate ACK tells the sender which segment got past the hole */
+                  socket->ts_sack=packet.future_use0;
+              }
+              /*
+               * Delayed ACK, every second segment, but right away around a gap so
+               * the sender repairs it, and at the end of a message that may expire
+               */
+              if(gap || (packet.control&EOR) || ++socket->ack_pending>=2){
+                  send_ack(socket);
               }
-              return EXIT_FAILURE;
           }
-          //sus
-          if(packet.ack_number!= socket->seq_number){
-              packet=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-              packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-              #ifdef  DEBUG
-              printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-              #endif
-              if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-                  perror("sending ACK packet");
-                  exit(EXIT_FAILURE);
+          if(mode==RECV_ZC){
+              copied=socket->buf_fill_level-socket->loaned;
+              copied=(copied<length)?copied:length;
+              continue;
+          }
+          if(mode==RECV_MSG){
+              if((copied=record_drain(socket,seg_stream,buffer,length))>0){
+                  *stream=seg_stream;
               }
-              return EXIT_FAILURE;
+              continue;
           }
-          //copy recvbuf to socket->recv_buf
-          memcpy(socket->recvbuf+socket->buf_fill_level,recv_buf+sizeof(microtcp_header_t),packet.data_len);
-          socket->buf_fill_level+=packet.data_len;
-          socket->ack_number=packet.seq_number;
-          packet=create_header(socket->seq_number,ACK,0,socket->ack_number,socket->init_win_size-socket->buf_fill_level);
-          packet.checksum=htonl(crc32((uint8_t*)&packet,sizeof(microtcp_header_t)));
-          #ifdef  DEBUG
-          printf("Sending ACK packet with ack number: %lu\n",socket->ack_number);
-          #endif
-          if(sendto(socket->sd,(void*)&packet,sizeof(microtcp_header_t),0,(struct sockaddr*)socket->address,socket->address_len)==-1){
-              perror("sending ACK packet");
+          if(mode==RECV_ANY && copied==0){
+              *stream=seg_stream;
+          }
+          if(placed>0){
+              if(data!=buffer+copied){
+                  memmove(buffer+copied,data,placed);
+              }
+              copied+=placed;
+          }
+          if(seg_stream==*stream){
+              copied+=stream_drain(socket,*stream,buffer+copied,length-copied);
           }
-          //copy recvbuf to socket->recvbuf
-      }
-      if(socket->buf_fill_level+(MAX_PAYLOAD_SIZE)>length){
-        memcpy(buffer,socket->recvbuf+start_buf_level,socket->buf_fill_level-start_buf_level);
-        //print the return
-        int retval=socket->buf_fill_level-start_buf_level;
-        socket->buf_fill_level=start_buf_level;
-        return retval;
       }
-      if( socket->buf_fill_level+(MAX_PAYLOAD_SIZE)>MICROTCP_RECVBUF_LEN){
-        memcpy(buffer,socket->recvbuf+start_buf_level,socket->buf_fill_level-start_buf_level);
-        //print the return
-        int retval=socket->buf_fill_level-start_buf_level;
-        socket->buf_fill_level=0;
-        return retval;
+    }
+    return copied;
+}
+
+/* Receives as recv_segments() does, streams with data waiting take turns */
+static ssize_t recv_data (microtcp_sock_t *socket, uint32_t *stream, int mode, void *buffer, size_t length, int flags){
+    size_t copied=0;
+    ssize_t received;
+    uint32_t i;
+    if(check_connected(socket)==-1){
+      return -1;
+    }
+    /* The peer may be waiting for what we hold back before it answers */
+    if(mode!=RECV_ZC && socket->loaned>0){
+      /* Draining stream 0 would move the bytes on loan */
+      errno=EBUSY;
+      return -1;
+    }
+    if(sndbuf_flush(socket)==-1){
+      return -1;
+    }
+    if(mode==RECV_STREAM){
+      copied=stream_drain(socket,*stream,buffer,length);
+    }else if(mode==RECV_ZC){
+      copied=socket->buf_fill_level-socket->loaned;
+      copied=(copied<length)?copied:length;
+    }else{
+      for(i = 0; i < MICROTCP_MAX_STREAMS && copied==0; i++){
+        *stream=(socket->recv_stream+i)%MICROTCP_MAX_STREAMS;
+        copied=(mode==RECV_MSG)?record_drain(socket,*stream,buffer,length):stream_drain(socket,*stream,buffer,length);
       }
+    }
+    if(socket->state==CLOSING_BY_PEER){
+      return (copied>0)?(ssize_t)copied:-1;
+    }
+    if(copied>0 && mode!=RECV_ZC){
+      /* The peer may be stalled on the window this read opened */
+      window_update(socket,*stream);
+    }
+    if((mode==RECV_MSG || mode==RECV_ZC) && copied>0){
+      received=copied;
+    }else{
+      received=recv_segments(socket,stream,(mode==RECV_ANY && copied>0)?RECV_STREAM:mode,(uint8_t*)buffer,length,copied,flags);
+    }
+    if((mode==RECV_ANY || mode==RECV_MSG) && received>0){
+      socket->recv_stream=(*stream+1)%MICROTCP_MAX_STREAMS;
+    }
+    /* No timer runs once we return, what is still unacknowledged is acknowledged now */
+    if(socket->ack_pending>0){
+      send_ack(socket);
+    }
+    if(received>0 && mode!=RECV_ZC){
+      window_update(socket,*stream);
+    }
+    timers_stop(socket);
+    return received;
+}
+
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags){
+    uint32_t stream=0;
+    return recv_data(socket,&stream,RECV_STREAM,buffer,length,flags);
+}
+
+ssize_t
+microtcp_recv_stream (microtcp_sock_t *socket, uint32_t *stream, void *buffer, size_t length, int flags){
+    return recv_data(socket,stream,RECV_ANY,buffer,length,flags);
+}
 
+ssize_t
+microtcp_recv_msg (microtcp_sock_t *socket, uint32_t *stream, void *buffer, size_t length, int flags){
+    return recv_data(socket,stream,RECV_MSG,buffer,length,flags);
+}
+
+ssize_t
+microtcp_recv_zc (microtcp_sock_t *socket, const void **data, size_t length, int flags){
+    uint32_t stream=0;
+    ssize_t received;
+    if(socket->loaned==MICROTCP_RECVBUF_LEN){
+        /* Nothing more can arrive before a release */
+        errno=ENOBUFS;
+        return -1;
+    }
+    received=recv_data(socket,&stream,RECV_ZC,NULL,length,flags);
+    if(received>0){
+        *data=socket->recvbuf+socket->loaned;
+        socket->loaned+=received;
+    }
+    return received;
+}
+
+int
+microtcp_recv_release (microtcp_sock_t *socket, size_t length){
+    if(check_connected(socket)==-1){
+        return -1;
     }
+    if(length>socket->loaned-socket->released){
+        errno=EINVAL;
+        return -1;
+    }
+    socket->released+=length;
+    if(socket->released<socket->loaned){
+        return 0;
+    }
+    /* Nothing is on loan any more, what arrived after the loans moves to the front */
+    stream_drain(socket,0,NULL,socket->loaned);
+    socket->loaned=0;
+    socket->released=0;
+    window_update(socket,0);
     return 0;
 }
 
+ssize_t
+microtcp_recvv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags){
+    ssize_t received;
+    size_t copied;
+    size_t n;
+    int i;
+    if(iovcnt<0 || (iovcnt>0 && !iov)){
+        errno=EINVAL;
+        return -1;
+    }
+    for(i = 0; i < iovcnt && iov[i].iov_len == 0; i++);
+    if(i==iovcnt){
+        return 0;
+    }
+    received=microtcp_recv(socket,iov[i].iov_base,iov[i].iov_len,flags);
+    if(received<=0 || (size_t)received<iov[i].iov_len){
+        return received;
+    }
+    /* What arrived past the first buffer waits in the stream, it goes to the next ones */
+    copied=received;
+    for(i++; i < iovcnt; i++){
+        n=stream_drain(socket,0,(uint8_t*)iov[i].iov_base,iov[i].iov_len);
+        copied+=n;
+        if(n<iov[i].iov_len){
+            break;
+        }
+    }
+    window_update(socket,0);
+    return copied;
+}
+
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, off_t offset, size_t length){
+    size_t page=sysconf(_SC_PAGESIZE);
+    struct stat sb;
+    uint8_t *buf=NULL;
+    uint8_t *map;
+    uint8_t *dst;
+    size_t stored=0;
+    size_t window;
+    size_t skew;
+    size_t got;
+    off_t start;
+    ssize_t n;
+    int grown=0;
+    int failed=0;
+    if(check_connected(socket)==-1){
+        return -1;
+    }
+    if(fstat(fd,&sb)==-1){
+        perror("recvfile stat");
+        return -1;
+    }
+    while(stored<length){
+        window=(length-stored<MICROTCP_FILE_WINDOW)?length-stored:MICROTCP_FILE_WINDOW;
+        start=offset+stored;
+        skew=start%page;
+        map=MAP_FAILED;
+        /*
+         * Direct placement may leave the payload of a datagram that is not
+         * ours past the data received, so only the part of the file grown
+         * here is mapped: the truncation below drops what lies past the
+         * data. What the file already holds goes through the buffer.
+         */
+        if(S_ISREG(sb.st_mode) && start>=sb.st_size && ftruncate(fd,start+window)==0){
+            grown=1;
+            map=mmap(NULL,window+skew,PROT_READ|PROT_WRITE,MAP_SHARED,fd,start-skew);
+        }
+        if(map==MAP_FAILED && buf==NULL && (buf=malloc(MICROTCP_FILE_WINDOW))==NULL){
+            perror("allocating file buffer");
+            failed=1;
+            break;
+        }
+        dst=(map!=MAP_FAILED)?map+skew:buf;
+        for(got=0;got<window;got+=n){
+            if((n=microtcp_recv(socket,dst+got,window-got,0))<=0){
+                break;
+            }
+        }
+        if(map!=MAP_FAILED){
+            munmap(map,window+skew);
+        }else if(file_write(fd,start,buf,got)==-1){
+            failed=1;
+            break;
+        }
+        stored+=got;
+        if(got<window){
+            break;
+        }
+    }
+    /* Give back the part of the file grown for data that never came */
+    if(grown && ftruncate(fd,(offset+(off_t)stored>sb.st_size)?offset+(off_t)stored:sb.st_size)==-1){
+        perror("recvfile truncate");
+    }
+    free(buf);
+    return (!failed && (stored>0 || length==0))?(ssize_t)stored:-1;
+}
+
 void print_header(microtcp_header_t header){
     printf("seq_number: %u\n",header.seq_number);
     printf("ack_number: %u\n",header.ack_number);
@@ -722,7 +3626,7 @@ void print_header(microtcp_header_t header){
     printf("checksum: %u\n",header.checksum);
 }
 
-int min(int a ,int b , int c){
+size_t min(size_t a ,size_t b , size_t c){
     if(a<b){
         if(a<c){
             return a;
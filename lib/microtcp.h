@@ -23,17 +23,58 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
+#include "../utils/histogram.h"
+
 /*
  * Several useful constants
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
 #define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_MAX_MSS 16384
+#define MICROTCP_RECVBUF_LEN 65535
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_RETRANSQ_LEN 64
+#define MICROTCP_TLP_MIN_US 10000
+#define MICROTCP_PLPMTU_MAX_PROBES 3
+#define MICROTCP_PLPMTU_MIN_STEP 32
+#define MICROTCP_SYN_RTO_US 50000     /**< First SYN/SYNACK timeout, doubled on every retry */
+#define MICROTCP_FASTOPEN_CACHE_LEN 64 /**< Servers whose fast open cookie is remembered */
+#define MICROTCP_SYN_RETRIES 5        /**< Handshake retransmissions before giving up, after about 3 s */
+#define MICROTCP_FIN_RETRIES 5        /**< FIN retransmissions before a closing connection is dropped */
+#define MICROTCP_FIN_WAIT_US 60000000 /**< How long an acknowledged FIN waits for the FIN of the peer */
+#define MICROTCP_TIME_WAIT_US 2000000 /**< Time in TIME_WAIT, answering retransmitted FINs of the peer */
+#define MICROTCP_TIMER_TICK_US 64     /**< Resolution of the timer wheel */
+#define MICROTCP_DELACK_US 40000      /**< Longest an in-order segment waits for its ACK */
+#define MICROTCP_PERSIST_MAX_US 1000000 /**< Longest interval between zero window probes */
+#define MICROTCP_CORK_US 200000       /**< After this a MICROTCP_CORK or MSG_MORE hold ends at the next send */
+#define MICROTCP_KEEPALIVE_PROBES 3   /**< Unanswered keepalive probes before the peer is declared dead */
+#define MICROTCP_MAX_STREAMS 16       /**< Streams of a connection, stream 0 is the one of microtcp_send() and microtcp_recv() */
+#define MICROTCP_TRACE_MAGIC 0x6d747472 /**< First word of a file written by microtcp_trace_save() */
+#define MICROTCP_FEC_MAX_BLOCK 64     /**< Most data segments one FEC parity segment covers */
+#define MICROTCP_FEC_BLOCKS 4         /**< FEC blocks a receiver decodes at a time */
+#define MICROTCP_FILE_WINDOW (8 << 20) /**< Bytes of a file mapped at a time by microtcp_sendfile() and microtcp_recvfile() */
+
+/*
+ * Options of microtcp_setsockopt()
+ */
+#define MICROTCP_NODELAY 1      /**< Send partial segments right away, setting it sends held data */
+#define MICROTCP_CORK 2         /**< Hold partial segments until the option is cleared, or until
+                                     a send past MICROTCP_CORK_US */
+#define MICROTCP_PLPMTUD 3      /**< Enable path MTU probing, on by default */
+#define MICROTCP_TRACE 4        /**< Size of the event trace ring in events, 0 turns tracing off */
+#define MICROTCP_FASTOPEN 5     /**< Server side, issue cookies and accept data on SYNs that carry one */
+#define MICROTCP_KEEPALIVE 6    /**< Probe a silent peer every value ms while receiving, 0 turns it off */
+#define MICROTCP_IDLE_TIMEOUT 7 /**< Fail a receive after value ms without a packet from the peer, 0 for never */
+#define MICROTCP_FEC 8          /**< Before connecting, send an XOR parity segment every value data
+                                     segments, 0 turns FEC off. It is on only if both peers set it,
+                                     with the longer of their two blocks */
+#define MICROTCP_COMPRESS 9     /**< Before connecting, compress the payload of data segments, on
+                                     only if both peers set it */
 
 #define SERVER 2
 #define CLIENT 1
@@ -41,6 +82,11 @@
 #define ACK 8
 #define SYNACK 10
 #define FINACK 9
+#define PROBE 16
+#define EOR 32          /**< Last segment of a message, see microtcp_send_msg() */
+#define SKIP 64         /**< The sender abandoned an expired message, skip it */
+#define FEC 128         /**< XOR parity of a block of data segments */
+#define COMPRESSED 256  /**< The payload is compressed, see utils/lz.h */
 /**
  * Possible states of the microTCP socket
  *
@@ -51,13 +97,167 @@ typedef enum
 {
   UNKNOWN,
   LISTEN,
+  SYN_SENT,
+  SYN_RECEIVED,
   ESTABLISHED,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
+  TIME_WAIT,
   CLOSED,
   INVALID
 } mircotcp_state_t;
 
+/**
+ * States of the packetization layer path MTU discovery (RFC 8899)
+ */
+typedef enum
+{
+  PLPMTU_DISABLED,
+  PLPMTU_SEARCHING,
+  PLPMTU_SEARCH_COMPLETE
+} microtcp_plpmtu_state_t;
+
+/**
+ * Kinds of events recorded in the trace ring
+ */
+typedef enum
+{
+  TRACE_SEND = 1,               /**< New data segment sent */
+  TRACE_RETRANSMIT,             /**< Data segment sent again */
+  TRACE_ACK,                    /**< ACK advancing the window received */
+  TRACE_DUP_ACK,                /**< Duplicate ACK received */
+  TRACE_TIMEOUT,                /**< Retransmission timeout */
+  TRACE_LOSS,                   /**< Loss detected, cwnd reduced */
+  TRACE_UNDO,                   /**< Spurious timeout, cwnd restored */
+  TRACE_RECV                    /**< Data segment accepted */
+} microtcp_trace_type_t;
+
+/**
+ * A fixed size trace record. It carries the congestion state right after
+ * the event, so a sequence of records is a time series of the flow.
+ */
+typedef struct
+{
+  uint64_t time_us;             /**< Monotonic time in microseconds */
+  uint32_t type;                /**< One of microtcp_trace_type_t */
+  uint32_t seq;                 /**< Sequence number of the segment or ACK number of the ACK */
+  uint32_t len;                 /**< Payload length of the segment */
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t peer_win;            /**< Window advertised by the peer */
+  uint32_t srtt_us;
+  uint32_t in_flight;           /**< Payload bytes in flight */
+} microtcp_trace_event_t;
+
+/**
+ * Single producer ring of trace events. The socket owner writes, any
+ * thread may read concurrently with microtcp_trace_read(). Old events
+ * are overwritten when the ring is full.
+ */
+typedef struct
+{
+  microtcp_trace_event_t *events; /**< Storage for mask + 1 events, NULL if tracing is off */
+  size_t mask;
+  uint64_t head;                /**< Number of events ever written */
+} microtcp_trace_t;
+
+
+struct timer_entry;
+
+/**
+ * A data segment that has been transmitted but not yet acknowledged.
+ * Segments are kept in the retransmission queue in sequence order.
+ */
+typedef struct
+{
+  uint32_t seq_start;           /**< Sequence number of the first payload byte */
+  uint32_t seq_end;             /**< Sequence number after the last payload byte,
+                                     the one carried in the header */
+  const uint8_t *data;          /**< Payload, referencing the buffer given to microtcp_send() */
+  uint32_t data_len;            /**< Payload length in bytes, before compression */
+  uint32_t stream;              /**< Stream the payload belongs to */
+  uint32_t stream_offset;       /**< Offset of the first payload byte in the stream */
+  uint16_t flags;               /**< EOR, SKIP or COMPRESSED, added to the control bits */
+  uint16_t fec_block;           /**< FEC block of the segment, 0 if it has none */
+  uint64_t sent_us;             /**< Monotonic time of the last (re)transmission in microseconds */
+  uint32_t retransmits;         /**< Number of times the segment has been retransmitted */
+  int lost;                     /**< Set when the segment is marked for retransmission */
+} microtcp_segment_t;
+
+/**
+ * Ring of in-flight segments, oldest first.
+ */
+typedef struct
+{
+  microtcp_segment_t *segs;     /**< Storage for MICROTCP_RETRANSQ_LEN segments */
+  size_t head;                  /**< Index of the oldest unacknowledged segment */
+  size_t count;                 /**< Number of segments in the queue */
+  size_t bytes_in_flight;       /**< Payload bytes sent and not marked lost */
+} microtcp_retransq_t;
+
+/**
+ * Sequence numbers or stream offsets received after a gap
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} microtcp_range_t;
+
+/**
+ * One of the byte streams multiplexed on a connection. Every stream has
+ * its own offsets, reassembly and window, so a segment lost on one stream
+ * does not hold back the data of the others.
+ */
+typedef struct
+{
+  uint8_t *recvbuf;             /**< In-order data not yet read, followed by the data that
+                                     arrived after a gap at its place. Allocated on the first
+                                     data, stream 0 uses the recvbuf of the socket */
+  size_t fill;                  /**< In-order bytes in recvbuf, buf_fill_level of the socket for stream 0 */
+  uint32_t recv_offset;         /**< Offset of the next in-order byte */
+  microtcp_range_t *ranges;     /**< Offsets received after the gap, sorted, at most
+                                     2 * MICROTCP_RETRANSQ_LEN */
+  size_t range_count;
+  uint32_t *records;            /**< End offsets of the messages received and not yet read,
+                                     sorted, at most 2 * MICROTCP_RETRANSQ_LEN */
+  size_t record_count;
+  uint32_t send_offset;         /**< Offset of the next new byte to send */
+  size_t unacked;               /**< Bytes sent and not yet acknowledged */
+  size_t peer_win;              /**< Window the peer advertised for the stream */
+  size_t ack_win;               /**< Window of the last ACK for the stream, unlike peer_win not
+                                     shrunk by the ACKs of other streams */
+  size_t adv_win;               /**< Window we last advertised for the stream */
+} microtcp_stream_t;
+
+/**
+ * A block of data segments being decoded. A segment lost from a block is
+ * the XOR of its parity segment and all the other segments of the block,
+ * so the receiver accumulates the XOR of whatever arrives.
+ */
+typedef struct
+{
+  uint32_t block;               /**< Block number, 0 for a free slot */
+  uint32_t count;               /**< Data segments in the block, 0 until its parity arrives */
+  uint32_t received;            /**< Data segments of the block received */
+  int done;                     /**< Nothing is missing, or the missing segment was rebuilt */
+  uint32_t seq;                 /**< XOR of the sequence numbers */
+  uint32_t offset;              /**< XOR of the stream offsets */
+  uint32_t meta;                /**< XOR of length << 16 | flags >> 5 << 8 | stream */
+  size_t len;                   /**< Bytes of acc in use */
+  uint8_t *acc;                 /**< XOR of the payloads, MICROTCP_MAX_MSS bytes */
+} microtcp_fec_block_t;
+
+/**
+ * A buffer to send on a stream, see microtcp_send_streams()
+ */
+typedef struct
+{
+  uint32_t stream;
+  const void *buffer;
+  size_t length;
+} microtcp_stream_buf_t;
+
 
 /**
  * This is the microTCP socket structure. It holds all the necessary
@@ -77,23 +277,144 @@ typedef struct
                                      is freed at the shutdown of the connection. This buffer is used
                                      to retrieve the data from the network. */
   size_t buf_fill_level;        /**< Amount of data in the buffer */
+  size_t loaned;                /**< Bytes at the start of recvbuf on loan, see microtcp_recv_zc() */
+  size_t released;              /**< Loaned bytes given back, freed once all are */
+  microtcp_stream_t *streams;   /**< MICROTCP_MAX_STREAMS streams, see microtcp_send_streams() */
+  uint32_t ack_stream;          /**< Stream whose window our next ACK advertises */
+  uint32_t recv_stream;         /**< Stream microtcp_recv_stream() looks at first */
+  microtcp_range_t *rcv_ranges; /**< Sequence numbers received after a gap, sorted, at most
+                                     MICROTCP_RETRANSQ_LEN */
+  size_t rcv_range_count;
 
   size_t cwnd;
   size_t ssthresh;
 
+  microtcp_retransq_t retransq; /**< Segments sent but not yet acknowledged */
+
+  uint32_t srtt_us;             /**< Smoothed RTT, 0 until the first sample */
+  uint32_t rttvar_us;           /**< RTT variation */
+  uint32_t min_rtt_us;          /**< Lowest RTT sample seen, sizes the RACK reordering window */
+  uint64_t rack_xmit_us;        /**< Send time of the most recent segment known to be delivered (RACK) */
+  uint64_t last_ack_us;         /**< Arrival time of the last ACK, arms the tail loss probe */
+  int tlp_outstanding;          /**< A tail loss probe is in flight */
+  uint32_t persist_us;          /**< Interval of the next zero window probe, 0 while the
+                                     window is open, doubles up to MICROTCP_PERSIST_MAX_US */
+  int in_recovery;              /**< Loss recovery in progress, cwnd is reduced once per episode */
+  uint32_t recovery_seq;        /**< Recovery ends when this sequence number is acknowledged */
+  uint32_t rcvtimeo_us;         /**< Current SO_RCVTIMEO of the UDP socket, 0 if not set */
+
+  size_t mss;                   /**< Current segment size, header included */
+  size_t max_mss;               /**< Largest segment size both peers accept, negotiated at the handshake */
+  microtcp_plpmtu_state_t plpmtu_state; /**< Path MTU probing state */
+  size_t probe_high;            /**< Smallest segment size known not to get through */
+  size_t probe_size;            /**< Size of the outstanding probe, 0 if there is none */
+  int probe_count;              /**< Unanswered probes of probe_size */
+  uint64_t probe_sent_us;       /**< Send time of the outstanding probe */
+  int rto_count;                /**< Consecutive timeouts, a path MTU black hole after two */
+  uint64_t syn_sent_us;         /**< Send time of the last SYN or SYNACK */
+  uint32_t syn_rto_us;          /**< Current handshake retransmission timeout */
+  int syn_retries;              /**< SYN or SYNACK retransmissions so far */
+  const uint8_t *syn_data;      /**< Data to carry on the SYN, see microtcp_connect_data() */
+  size_t syn_data_len;          /**< Its length, after the handshake the part the server accepted */
+  uint32_t syn_cookie;          /**< Fast open cookie sent with the SYN, 0 for none */
+  int fastopen;                 /**< MICROTCP_FASTOPEN option */
+  struct timer_entry *timers;   /**< Retransmission, persist, delayed ACK, keepalive and idle
+                                     timers, on the timer wheel of the calling thread while
+                                     a call of the socket waits */
+  unsigned int timers_fired;    /**< Bit mask of the timers expired during the last wait */
+  int ack_pending;              /**< In-order segments received and not acknowledged yet */
+  uint64_t ack_pending_us;      /**< Arrival of the first of them */
+  uint64_t last_recv_us;        /**< Arrival of the last valid packet from the peer */
+  uint32_t keepalive_us;        /**< MICROTCP_KEEPALIVE option */
+  uint32_t idle_us;             /**< MICROTCP_IDLE_TIMEOUT option */
+  int keepalive_probes;         /**< Keepalive probes sent since the peer was last heard */
+
+  uint8_t *sndbuf;              /**< Coalescing buffer holding a not yet sent partial segment,
+                                     MICROTCP_MAX_MSS bytes, LZ_MAX_INPUT once compressing */
+  size_t sndbuf_len;            /**< Bytes waiting in sndbuf */
+  int nodelay;                  /**< MICROTCP_NODELAY option */
+  int cork;                     /**< MICROTCP_CORK option */
+  uint64_t cork_deadline;       /**< When the data in sndbuf held by MICROTCP_CORK or MSG_MORE is due */
+  uint32_t ts_recent;           /**< Timestamp of the last in-order segment, echoed in our ACKs */
+  uint32_t ts_sack;             /**< Timestamp of the segment that arrived past a gap, carried
+                                     by the next ACK only */
+  uint32_t fec_k;               /**< Data segments per parity segment, the MICROTCP_FEC option until
+                                     the handshake settles it, 0 if FEC is off */
+  uint32_t fec_block;           /**< Number of the block being sent, 1 to 65535 */
+  uint32_t fec_count;           /**< Segments of that block sent so far */
+  uint32_t fec_seq;             /**< XORs of their headers, as in microtcp_fec_block_t */
+  uint32_t fec_offset;
+  uint32_t fec_meta;
+  size_t fec_len;               /**< Bytes of fec_parity in use */
+  uint8_t *fec_parity;          /**< XOR of their payloads, MICROTCP_MAX_MSS bytes */
+  uint64_t fec_first_us;        /**< Send time of the first segment of the block */
+  microtcp_fec_block_t *fec_blocks; /**< MICROTCP_FEC_BLOCKS blocks being received */
+  int compress;                 /**< MICROTCP_COMPRESS option until the handshake settles it */
+  uint8_t *ztx;                 /**< Compressed payload of the segment last sent, MICROTCP_MAX_MSS bytes */
+  uint32_t ztx_seq;             /**< End sequence number of that segment */
+  size_t ztx_len;               /**< Bytes of ztx in use, 0 if it holds nothing */
+  uint8_t *zrx;                 /**< Payload of a received segment once decompressed */
+  uint32_t zskip;               /**< Segments still sent uncompressed after data that did not compress */
+  uint32_t zbackoff;            /**< zskip after the next such failure, doubles up to 64 */
+  size_t zhold;                 /**< Data microtcp_send() gathers for a segment, what fills one at the
+                                     last compression ratio, 0 for a segment payload */
+  int rto_undo;                 /**< 1 after a timeout until the first retransmission,
+                                     2 while waiting for the ACK that validates the timeout */
+  uint32_t rto_tsval;           /**< Timestamp of the first retransmission after the timeout */
+  size_t prior_cwnd;            /**< cwnd before the timeout, restored if it was spurious */
+  size_t prior_ssthresh;        /**< ssthresh before the timeout, restored if it was spurious */
+  int prior_in_recovery;        /**< Recovery state before the timeout */
+
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
+  uint64_t packets_send;        /**< Datagrams sent, retransmissions and control packets included */
+  uint64_t packets_received;    /**< Valid datagrams received */
+  uint64_t packets_lost;        /**< Data segments declared lost */
+  uint64_t bytes_send;          /**< Payload bytes sent, retransmissions included, as they went
+                                     on the wire */
+  uint64_t bytes_received;      /**< Payload bytes accepted */
+  uint64_t bytes_lost;          /**< Payload bytes of the segments declared lost */
+  uint64_t retransmits;         /**< Data segments retransmitted, tail loss probes included */
+  uint64_t timeouts;            /**< Retransmission timeouts */
+  uint64_t spurious_timeouts;   /**< Timeouts undone because the ACKs were only late */
+  uint64_t dup_acks;            /**< Duplicate ACKs received */
+  uint64_t fec_repairs;         /**< Lost segments rebuilt from FEC parity */
+  uint64_t bytes_saved;         /**< Payload bytes compression kept off the wire */
+  histogram_t rtt_hist;         /**< Distribution of the RTT samples in microseconds */
+  microtcp_trace_t trace;       /**< Event trace, see MICROTCP_TRACE */
+  struct sockaddr *address;
+  socklen_t address_len;
+  int fun;
+  int fin;
+} microtcp_sock_t;
+
+
+/**
+ * Snapshot of the counters of a microTCP socket, see microtcp_get_stats()
+ */
+typedef struct
+{
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
-  struct sockaddr *address;
-  socklen_t address_len;
-  int fun;
-  int fin;
-} microtcp_sock_t;
+  uint64_t retransmits;
+  uint64_t timeouts;
+  uint64_t spurious_timeouts;
+  uint64_t dup_acks;
+  uint64_t fec_repairs;
+  uint64_t bytes_saved;
+  uint32_t rtt_min_us;          /**< Lowest RTT sample */
+  uint32_t rtt_avg_us;          /**< Mean of all RTT samples */
+  uint32_t rtt_p99_us;          /**< 99th percentile of the RTT samples */
+  uint32_t srtt_us;             /**< Current smoothed RTT */
+  size_t cwnd;
+  size_t ssthresh;
+  size_t peer_win_size;         /**< Last window advertised by the peer */
+  size_t mss;                   /**< Current segment size */
+} microtcp_stats_t;
 
 
 /**
@@ -106,10 +427,16 @@ typedef struct
   uint32_t ack_number;          /**< ACK number */
   uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
   uint16_t window;              /**< Window size in bytes */
-  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
-  uint32_t future_use0;         /**< 32-bits for future use */
-  uint32_t future_use1;         /**< 32-bits for future use */
-  uint32_t future_use2;         /**< 32-bits for future use */
+  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header), once compressed */
+  uint32_t future_use0;         /**< 32-bits for future use, carries the sender timestamp, and
+                                     in ACKs that of a segment received past a gap, or 0 */
+  uint32_t future_use1;         /**< 32-bits for future use, echoes the peer timestamp in ACKs
+                                     and carries the stream offset in data segments */
+  uint32_t future_use2;         /**< 32-bits for future use, the MSS in SYN/SYNACK, the
+                                     probe size in probe ACKs and the stream in data segments
+                                     and ACKs. The upper 16 bits carry the FEC block length in
+                                     SYN/SYNACK, its bit 24 asking for compression, and the FEC
+                                     block in data segments */
   uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
 } microtcp_header_t;
 
@@ -121,12 +448,49 @@ int
 microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
                socklen_t address_len);
 
+/**
+ * Connects to a remote peer. The SYN is retransmitted with exponential
+ * backoff starting from MICROTCP_SYN_RTO_US.
+ *
+ * @return 0 on success or -1 if the peer did not answer after
+ * MICROTCP_SYN_RETRIES retransmissions (errno ETIMEDOUT)
+ */
 int
 microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
                   socklen_t address_len);
 
 /**
- * Blocks waiting for a new connection from a remote peer.
+ * Connects to a remote peer and sends the first data. If the server gave
+ * this host a fast open cookie in an earlier connection, up to one base
+ * size segment of the data travels on the SYN and the server gets it
+ * without waiting for the handshake to complete. Otherwise, or if the
+ * server rejects the cookie, the data is sent after the handshake and a
+ * cookie is collected for next time.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_connect_data (microtcp_sock_t *socket, const struct sockaddr *address,
+                       socklen_t address_len, const void *buffer,
+                       size_t length);
+
+/**
+ * Connects count sockets to their peers concurrently, so setting them all
+ * up takes about as long as the slowest handshake.
+ *
+ * @param sockets count sockets created with microtcp_socket()
+ * @param addresses the peer of each socket
+ * @return the number of sockets that got ESTABLISHED, the others are CLOSED
+ */
+int
+microtcp_connect_many (microtcp_sock_t *sockets,
+                       const struct sockaddr *const *addresses,
+                       socklen_t address_len, size_t count);
+
+/**
+ * Blocks waiting for a new connection from a remote peer. The SYNACK is
+ * retransmitted until the handshake completes; a peer that goes silent is
+ * abandoned after MICROTCP_SYN_RETRIES and the socket listens again.
  *
  * @param socket the socket structure
  * @param address pointer to store the address information of the connected peer
@@ -138,15 +502,251 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Closes the connection without waiting for the peer. Held data is sent,
+ * then the FIN exchange and TIME_WAIT are completed by a background thread
+ * that retransmits the FIN as needed, and the data buffers of the socket
+ * are released. The counters, the RTT histogram and the trace stay valid;
+ * the trace ring is freed by setting MICROTCP_TRACE to 0 once it was read.
+ * The caller may close the UDP socket right after this call. At exit the
+ * process waits until the FINs still in flight are acknowledged or given up.
+ *
+ * The background thread answers the peer on a socket of its own, bound to
+ * the same local address, so it holds the port for up to
+ * MICROTCP_FIN_WAIT_US plus MICROTCP_TIME_WAIT_US. Sockets are created with
+ * SO_REUSEADDR so a new one may bind the port meanwhile. Afterwards sends
+ * and receives fail with ENOTCONN, accept and connect with EBADF.
+ *
+ * @return 0 on success or -1 if the socket is not connected (errno ENOTCONN)
+ */
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Sends data to the peer and waits until all of it is acknowledged. With
+ * MICROTCP_CORK set or MSG_MORE, only whole segments go out and a partial
+ * segment at the end is kept in the socket to be completed by a later call.
+ * It is sent by the first call that completes it or does not hold it,
+ * before microtcp_recv() waits for data, at shutdown, or on its own by the
+ * first microtcp_send() past MICROTCP_CORK_US after it was held. No timer
+ * outlives the call, so any thread may make the next call on the socket.
+ *
+ * @param flags MSG_MORE holds the partial segment even with MICROTCP_NODELAY
+ * @return the number of bytes accepted or -1 on failure
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Sends the iovcnt buffers of iov on stream 0 as one piece of data, the
+ * way microtcp_send() sends a single buffer without MSG_MORE, and
+ * waits until all of it is acknowledged. Segments span buffer boundaries:
+ * whole segments are sent from the buffers in place and only the data of
+ * a segment that crosses a boundary is gathered. Held data of
+ * microtcp_send() is sent first.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt);
+
+/**
+ * Sends data on one stream of the connection, see microtcp_send_streams().
+ *
+ * @param stream from 0 to MICROTCP_MAX_STREAMS - 1
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_send_stream (microtcp_sock_t *socket, uint32_t stream,
+                      const void *buffer, size_t length);
+
+/**
+ * Sends several buffers, each on its own stream, and waits until all of
+ * them are acknowledged. Segments of the buffers are interleaved, so a
+ * short control message is not queued behind a bulk transfer, and the
+ * peer delivers every stream as soon as its own data is complete.
+ * Data of the same stream is delivered in the order of the buffers.
+ * Held data of microtcp_send() is sent first.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_send_streams (microtcp_sock_t *socket,
+                       const microtcp_stream_buf_t *bufs, size_t count);
+
+/**
+ * Sends a message on a stream, for the peer to receive whole with
+ * microtcp_recv_msg(). A message not acknowledged within its lifetime is
+ * abandoned: its fragments are not retransmitted any more and the peer is
+ * told to skip it, so late data costs no further round trips.
+ *
+ * @param lifetime_ms 0 to retransmit until the message is delivered
+ * @return length once the peer has the message, 0 if it was abandoned
+ * (the peer may still have got it whole), or -1 on failure
+ */
+ssize_t
+microtcp_send_msg (microtcp_sock_t *socket, uint32_t stream, const void *buffer,
+                   size_t length, uint32_t lifetime_ms);
+
+/**
+ * Sends length bytes of the file fd from offset on stream 0, as
+ * microtcp_send() would. The file is mapped MICROTCP_FILE_WINDOW bytes at
+ * a time and segments reference the mapping, so the data is never copied
+ * in user space. Files that cannot be mapped are read a window at a time.
+ * The file offset of fd is left alone.
+ *
+ * @return the number of bytes sent, less than length if the file ends
+ * first, or -1 on failure
+ */
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset,
+                   size_t length);
+
+/**
+ * Sets a microTCP socket option.
+ *
+ * @param optname one of MICROTCP_NODELAY, MICROTCP_CORK, MICROTCP_PLPMTUD,
+ * MICROTCP_TRACE, MICROTCP_FASTOPEN, MICROTCP_KEEPALIVE, MICROTCP_IDLE_TIMEOUT,
+ * MICROTCP_FEC or MICROTCP_COMPRESS
+ * @param value 0 to clear the option, non zero to set it. Clearing
+ * MICROTCP_CORK or setting MICROTCP_NODELAY sends any held data.
+ * For MICROTCP_TRACE the ring size in events, rounded up to a power of two.
+ * For MICROTCP_FEC the data segments per parity segment, at most
+ * MICROTCP_FEC_MAX_BLOCK, set before connecting.
+ * MICROTCP_COMPRESS non zero before connecting compresses the payload of
+ * data segments, only if the peer sets it as well.
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int optname, int value);
+
+/**
+ * Copies the traffic counters, RTT distribution and congestion state of
+ * the socket into stats. Cheap enough to be polled while a flow runs.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_get_stats (const microtcp_sock_t *socket, microtcp_stats_t *stats);
+
+/**
+ * Copies the trace events written since *cursor into events and advances
+ * the cursor. Events overwritten before they could be read are skipped.
+ * Safe to call from another thread while the socket is in use.
+ *
+ * @param cursor 0 on the first call, then the value left by the previous call
+ * @return the number of events copied
+ */
+size_t
+microtcp_trace_read (const microtcp_sock_t *socket, uint64_t *cursor,
+                     microtcp_trace_event_t *events, size_t max);
+
+/**
+ * Writes the events still in the trace ring to a binary file, to be
+ * converted to CSV by the trace_dump tool.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_trace_save (const microtcp_sock_t *socket, const char *path);
+
+/**
+ * Receives data from the peer, waiting until at least one byte is available,
+ * or until length bytes are when flags has MSG_WAITALL. In-order segments
+ * are acknowledged every second one, and before return. While at least
+ * MICROTCP_MAX_MSS bytes of the buffer are free, segments are received
+ * straight into it, so the bytes past the returned length may be modified.
+ *
+ * @return the number of bytes received, or -1 on failure, when the peer has
+ * closed the connection, when a signal interrupted the wait (errno EINTR),
+ * or when the peer was silent past MICROTCP_IDLE_TIMEOUT or did not answer
+ * MICROTCP_KEEPALIVE_PROBES keepalives (errno ETIMEDOUT). With MSG_WAITALL
+ * these end the wait early and the bytes received so far are returned.
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Receives data of any stream, like microtcp_recv() does for stream 0.
+ * The returned bytes all belong to one stream; streams with data waiting
+ * take turns.
+ *
+ * @param stream set to the stream of the returned data
+ * @return the number of bytes received or -1 as for microtcp_recv()
+ */
+ssize_t
+microtcp_recv_stream (microtcp_sock_t *socket, uint32_t *stream, void *buffer,
+                      size_t length, int flags);
+
+/**
+ * Receives the next complete message of any stream, see microtcp_send_msg().
+ * Messages the sender abandoned are skipped. Streams carrying messages with
+ * a lifetime must only be read with this call.
+ *
+ * @param stream set to the stream of the message
+ * @return the length of the message, cut to length if longer, or -1 as
+ * for microtcp_recv()
+ */
+ssize_t
+microtcp_recv_msg (microtcp_sock_t *socket, uint32_t *stream, void *buffer,
+                   size_t length, int flags);
+
+/**
+ * Receives data of stream 0 without copying it. *data is set to the bytes
+ * in the receive buffer of the socket, which are loaned to the caller until
+ * microtcp_recv_release() gives them back. Loans are handed out in sequence
+ * order, each after the previous one, and all stay valid together. While
+ * the buffer has room, segments are received straight into it.
+ *
+ * The loaned bytes keep their space in the advertised window, the peer
+ * stops once the buffer is full. No other receive call may be used while
+ * bytes are on loan, they fail with errno EBUSY.
+ *
+ * @return the number of bytes loaned, at most length, or -1 as
+ * microtcp_recv() does, or with errno ENOBUFS when the whole buffer is on loan
+ */
+ssize_t
+microtcp_recv_zc (microtcp_sock_t *socket, const void **data, size_t length, int flags);
+
+/**
+ * Gives back the oldest length bytes loaned by microtcp_recv_zc(). Once no
+ * byte is on loan their space returns to the advertised window, and the
+ * peer is told if it was held back.
+ *
+ * @return 0 on success, or -1 with errno EINVAL if fewer bytes are on loan
+ */
+int
+microtcp_recv_release (microtcp_sock_t *socket, size_t length);
+
+/**
+ * Receives data of stream 0 as microtcp_recv() does, scattered over the
+ * iovcnt buffers of iov in order. A buffer is filled before the next one
+ * gets data.
+ *
+ * @return the number of bytes received, or -1 as for microtcp_recv() or with
+ * errno EINVAL if iovcnt is negative, or iov NULL with buffers
+ */
+ssize_t
+microtcp_recvv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags);
+
+/**
+ * Receives up to length bytes of stream 0 into the file fd from offset on,
+ * returning once all of them arrived or the peer closed the connection.
+ * fd must be open for reading and writing. Past the end of the file it is
+ * grown and mapped MICROTCP_FILE_WINDOW bytes at a time, the data goes from
+ * the receive buffer straight into the mapping, and the file is cut back
+ * if the data ends before the mapped part. What overwrites the existing
+ * content of the file, or goes to a file that cannot be mapped, is written
+ * a window at a time.
+ *
+ * @return the number of bytes stored, or -1 as for microtcp_recv() if
+ * none were
+ */
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, off_t offset,
+                   size_t length);
+
 
 #endif /* LIB_MICROTCP_H_ */
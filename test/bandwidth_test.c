@@ -28,6 +28,8 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -36,358 +38,783 @@
 #include "../lib/microtcp.h"
 
 #define CHUNK_SIZE 4096
+#define TRACE_EVENTS 65536
+#define MAX_STREAMS 64
+#define DEFAULT_DURATION 10.0
+/* File bytes per microtcp_sendfile() and microtcp_recvfile() call, a unit of progress */
+#define FILE_STEP (1 << 20)
+
+typedef struct run run_t;
+
+/**
+ * One connection of a run, served by its own thread on port + id
+ */
+typedef struct
+{
+  run_t *run;
+  int id;
+  uint64_t bytes;               /* Payload moved so far, updated atomically */
+  struct timespec start;
+  struct timespec end;
+  int result;
+  int has_stats;
+  microtcp_stats_t stats;
+} stream_t;
+
+typedef struct
+{
+  double start;                 /* Seconds since the start of the run */
+  double end;
+  uint64_t bytes;
+} interval_t;
+
+/**
+ * A set of parallel streams over one protocol
+ */
+struct run
+{
+  int use_microtcp;
+  int is_server;
+  const char *serverip;
+  uint16_t port;
+  int nstreams;
+  const char *file;             /* NULL for the memory to memory mode */
+  size_t write_size;
+  double duration;              /* Seconds to send for in memory to memory mode */
+  stream_t streams[MAX_STREAMS];
+  pthread_t threads[MAX_STREAMS];
+  int active;                   /* Streams still running */
+  int started;                  /* Set when the first stream has connected */
+  struct timespec start;
+  pthread_mutex_t lock;
+  interval_t *intervals;
+  size_t nintervals;
+  uint64_t reported_bytes;
+  double next_report;
+  int reports_done;             /* The last, partial, interval has been reported */
+};
+
+/* File the microTCP event trace of the first stream is saved to, NULL if not requested */
+static const char *trace_file = NULL;
+/* Seconds between interval reports, 0 for none */
+static double interval = 0;
+static int json = 0;
+/* MICROTCP_FEC block length, 0 for no FEC */
+static int fec_block = 0;
+/* MICROTCP_COMPRESS */
+static int compress = 0;
+/* The microTCP server reads with microtcp_recv_zc() */
+static int zero_copy = 0;
+
+static double
+elapsed_s (struct timespec start, struct timespec end)
+{
+  return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
 
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
-  double elapsed = end.tv_sec - start.tv_sec
-      + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  double elapsed = elapsed_s (start, end);
   double megabytes = received / (1024.0 * 1024.0);
-  printf ("Data received: %f MB\n", megabytes);
+  printf ("Data transferred: %f MB\n", megabytes);
   printf ("Transfer time: %f seconds\n", elapsed);
   printf ("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
-int
-server_tcp (uint16_t listen_port, const char *file)
+/* Saves the trace of the first stream, then frees the ring of every stream */
+static void
+save_trace (stream_t *s, microtcp_sock_t *socket)
+{
+  if (trace_file && s->id == 0 && microtcp_trace_save (socket, trace_file) == 0
+      && !json) {
+    printf ("Trace saved to %s\n", trace_file);
+  }
+  microtcp_setsockopt (socket, MICROTCP_TRACE, 0);
+}
+
+/* Marks the stream connected, the first one starts the clock of the run */
+static void
+stream_started (stream_t *s)
 {
+  run_t *run = s->run;
+  clock_gettime (CLOCK_MONOTONIC, &s->start);
+  s->end = s->start;
+  pthread_mutex_lock (&run->lock);
+  if (!run->started) {
+    run->start = s->start;
+    run->next_report = interval;
+    run->started = 1;
+  }
+  pthread_mutex_unlock (&run->lock);
+}
+
+static void
+stream_add (stream_t *s, size_t bytes)
+{
+  __atomic_fetch_add (&s->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* In memory to memory mode the client sends until the duration has passed */
+static int
+stream_done (stream_t *s)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return elapsed_s (s->start, now) >= s->run->duration;
+}
+
+static int
+server_tcp (stream_t *s)
+{
+  run_t *run = s->run;
   uint8_t *buffer;
-  FILE *fp;
+  FILE *fp = NULL;
   int sock;
   int accepted;
+  int one = 1;
   ssize_t received;
-  ssize_t written;
-  ssize_t total_bytes = 0;
   socklen_t client_addr_len;
 
   struct sockaddr_in sin;
   struct sockaddr client_addr;
-  struct timespec start_time;
-  struct timespec end_time;
 
   /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
+  buffer = (uint8_t *) malloc (run->write_size);
   if (!buffer) {
     perror ("Allocate application receive buffer");
     return -EXIT_FAILURE;
   }
 
   /* Open the file for writing the data from the network */
-  fp = fopen (file, "w");
-  if (!fp) {
-    perror ("Open file for writing");
-    free (buffer);
-    return -EXIT_FAILURE;
+  if (run->file) {
+    fp = fopen (run->file, "w");
+    if (!fp) {
+      perror ("Open file for writing");
+      free (buffer);
+      return -EXIT_FAILURE;
+    }
   }
 
   if ((sock = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
     perror ("Opening TCP socket");
     free (buffer);
-    fclose (fp);
+    if (fp) {
+      fclose (fp);
+    }
     return -EXIT_FAILURE;
   }
+  setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
-  sin.sin_port = htons (listen_port);
+  sin.sin_port = htons (run->port + s->id);
   /* Bind to all available network interfaces */
   sin.sin_addr.s_addr = INADDR_ANY;
 
-  if (bind (sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
-    perror ("TCP bind");
+  if (bind (sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || listen (sock, 1000) == -1) {
+    perror ("TCP bind/listen");
+    close (sock);
     free (buffer);
-    fclose (fp);
-    return -EXIT_FAILURE;
-  }
-
-  if (listen (sock, 1000) == -1) {
-    perror ("TCP listen");
-    free (buffer);
-    fclose (fp);
+    if (fp) {
+      fclose (fp);
+    }
     return -EXIT_FAILURE;
   }
 
   /* Accept a connection from the client */
   client_addr_len = sizeof(struct sockaddr);
   accepted = accept (sock, &client_addr, &client_addr_len);
+  close (sock);
   if (accepted < 0) {
     perror ("TCP accept");
     free (buffer);
-    fclose (fp);
+    if (fp) {
+      fclose (fp);
+    }
     return -EXIT_FAILURE;
   }
 
-  /*
-   * Start processing the received data.
-   *
-   * Also start measuring time. Not the most accurate measurement, but
-   * it is a good starting point.
-   *
-   * At hy-435 we deal with bandwidth measurements software in a more
-   * right and careful way :-)
-   */
-
-  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
-  while ((received = recv (accepted, buffer, CHUNK_SIZE, 0)) > 0) {
-    written = fwrite (buffer, sizeof(uint8_t), received, fp);
-    total_bytes += received;
-    if (written * sizeof(uint8_t) != (size_t)received) {
+  stream_started (s);
+  while ((received = recv (accepted, buffer, run->write_size, 0)) > 0) {
+    if (fp && fwrite (buffer, sizeof(uint8_t), received, fp) != (size_t) received) {
       printf ("Failed to write to the file the"
               " amount of data received from the network.\n");
       shutdown (accepted, SHUT_RDWR);
-      shutdown (sock, SHUT_RDWR);
       close (accepted);
-      close (sock);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
     }
+    stream_add (s, received);
+    clock_gettime (CLOCK_MONOTONIC, &s->end);
   }
-  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
-  print_statistics (total_bytes, start_time, end_time);
 
   shutdown (accepted, SHUT_RDWR);
-  shutdown (sock, SHUT_RDWR);
   close (accepted);
-  close (sock);
-  fclose (fp);
+  if (fp) {
+    fclose (fp);
+  }
   free (buffer);
-
   return 0;
 }
 
-int
-server_microtcp (uint16_t listen_port, const char *file)
+static int
+server_microtcp (stream_t *s)
 {
-  /*TODO: Write your code here */
+  run_t *run = s->run;
   uint8_t *buffer;
-  FILE *fp;
-  int sock;
-  int accepted;
+  int fd = -1;
+  off_t offset = 0;
   ssize_t received;
-  ssize_t written;
-  ssize_t total_bytes = 0;
-  socklen_t client_addr_len;
+  const void *data;
   microtcp_sock_t socket;
-  int domain=AF_INET;
-  int type=SOCK_DGRAM;
-  int protocol=0;
-  socket=microtcp_socket(domain,type,protocol);
   struct sockaddr_in sin;
   struct sockaddr client_addr;
-  struct timespec start_time;
-  struct timespec end_time;
+
+  socket = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
   /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
+  buffer = (uint8_t *) malloc (run->write_size);
   if (!buffer) {
     perror ("Allocate application receive buffer");
     return -EXIT_FAILURE;
   }
-  /* Open the file for writing the data from the network */
-  fp = fopen (file, "w");
-  if (!fp) {
-    perror ("Open file for writing");
-    free (buffer);
-    return -EXIT_FAILURE;
+  /* Open the file for the data from the network, microTCP writes it directly */
+  if (run->file) {
+    fd = open (run->file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      perror ("Open file for writing");
+      free (buffer);
+      return -EXIT_FAILURE;
+    }
   }
-  //microtcp
-  memset(&sin, 0, sizeof(struct sockaddr_in));
+  memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
-  sin.sin_port = htons (listen_port);
+  sin.sin_port = htons (run->port + s->id);
   /* Bind to all available network interfaces */
   sin.sin_addr.s_addr = INADDR_ANY;
-  microtcp_bind(&socket,(struct sockaddr*)&sin,sizeof(struct sockaddr_in));
-  if(microtcp_accept(&socket,(struct sockaddr *)&client_addr,sizeof(struct sockaddr) ) == -1){
-      printf("Cannot accept\n");
-      return -1;
+  microtcp_bind (&socket, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
+  if (trace_file && s->id == 0) {
+    microtcp_setsockopt (&socket, MICROTCP_TRACE, TRACE_EVENTS);
+  }
+  if (fec_block > 0) {
+    microtcp_setsockopt (&socket, MICROTCP_FEC, fec_block);
+  }
+  if (compress) {
+    microtcp_setsockopt (&socket, MICROTCP_COMPRESS, 1);
+  }
+  if (microtcp_accept (&socket, &client_addr, sizeof(struct sockaddr)) == -1) {
+    printf ("Cannot accept\n");
+    free (buffer);
+    if (fd != -1) {
+      close (fd);
+    }
+    return -EXIT_FAILURE;
   }
 
-  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
-  while ((received = microtcp_recv (&socket, buffer, CHUNK_SIZE, 0)) > 0) {
-    written = fwrite (buffer, sizeof(uint8_t), received, fp);
-    total_bytes += received;
-    if (written * sizeof(uint8_t) != (size_t)received) {
-      printf ("Failed to write to the file the"
-              " amount of data received from the network.\n");
-      microtcp_shutdown (&socket, SHUT_RDWR);
-      close (socket.sd);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
+  stream_started (s);
+  for (;;) {
+    if (fd != -1) {
+      received = microtcp_recvfile (&socket, fd, offset, FILE_STEP);
+      offset += (received > 0) ? received : 0;
+    }
+    else if (zero_copy) {
+      received = microtcp_recv_zc (&socket, &data, run->write_size, 0);
+      if (received > 0) {
+        microtcp_recv_release (&socket, received);
+      }
+    }
+    else {
+      received = microtcp_recv (&socket, buffer, run->write_size, 0);
     }
+    if (received <= 0) {
+      break;
+    }
+    stream_add (s, received);
+    clock_gettime (CLOCK_MONOTONIC, &s->end);
   }
-  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
-  print_statistics (total_bytes, start_time, end_time);
-  fclose (fp);
   microtcp_shutdown (&socket, SHUT_RDWR);
+  microtcp_get_stats (&socket, &s->stats);
+  s->has_stats = 1;
+  save_trace (s, &socket);
   close (socket.sd);
+  if (fd != -1) {
+    close (fd);
+  }
   free (buffer);
   return 0;
 }
 
-int
-client_tcp (const char *serverip, uint16_t server_port, const char *file)
+static int
+client_tcp (stream_t *s)
 {
+  run_t *run = s->run;
   uint8_t *buffer;
   int sock;
-  socklen_t client_addr_len;
-  FILE *fp;
-  size_t read_items = 0;
-  size_t data_sent;
-
-  struct sockaddr *client_addr;
+  FILE *fp = NULL;
+  size_t read_items;
+  size_t offset;
+  ssize_t data_sent;
+  struct sockaddr_in sin;
 
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
+  /* Allocate memory for the application send buffer */
+  buffer = (uint8_t *) calloc (1, run->write_size);
   if (!buffer) {
-    perror ("Allocate application receive buffer");
+    perror ("Allocate application send buffer");
     return -EXIT_FAILURE;
   }
 
-  /* Open the file for writing the data from the network */
-  fp = fopen (file, "r");
-  if (!fp) {
-    perror ("Open file for reading");
-    free (buffer);
-    return -EXIT_FAILURE;
+  /* Open the file that will be transmitted */
+  if (run->file) {
+    fp = fopen (run->file, "r");
+    if (!fp) {
+      perror ("Open file for reading");
+      free (buffer);
+      return -EXIT_FAILURE;
+    }
   }
 
   if ((sock = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
     perror ("Opening TCP socket");
     free (buffer);
-    fclose (fp);
+    if (fp) {
+      fclose (fp);
+    }
     return -EXIT_FAILURE;
   }
 
-  struct sockaddr_in sin;
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
   /*Port that server listens at */
-  sin.sin_port = htons (server_port);
+  sin.sin_port = htons (run->port + s->id);
   /* The server's IP*/
-  sin.sin_addr.s_addr = inet_addr (serverip);
+  sin.sin_addr.s_addr = inet_addr (run->serverip);
 
   if (connect (sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in))
       == -1) {
     perror ("TCP connect");
-    exit (EXIT_FAILURE);
+    close (sock);
+    free (buffer);
+    if (fp) {
+      fclose (fp);
+    }
+    return -EXIT_FAILURE;
   }
 
-  printf ("Starting sending data...\n");
+  stream_started (s);
   /* Start sending the data */
-  while (!feof (fp)) {
-    read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1) {
-      perror ("Failed read from file");
-      shutdown (sock, SHUT_RDWR);
-      close (sock);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
+  for (;;) {
+    if (fp) {
+      read_items = fread (buffer, sizeof(uint8_t), run->write_size, fp);
+      if (read_items < 1) {
+        break;
+      }
     }
-
-    data_sent = send (sock, buffer, read_items * sizeof(uint8_t), 0);
-    if (data_sent != read_items * sizeof(uint8_t)) {
-      printf ("Failed to send the"
-              " amount of data read from the file.\n");
-      shutdown (sock, SHUT_RDWR);
-      close (sock);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
+    else if (stream_done (s)) {
+      break;
     }
-
+    else {
+      read_items = run->write_size;
+    }
+    for (offset = 0; offset < read_items; offset += data_sent) {
+      data_sent = send (sock, buffer + offset, read_items - offset, 0);
+      if (data_sent < 0) {
+        perror ("TCP send");
+        shutdown (sock, SHUT_RDWR);
+        close (sock);
+        free (buffer);
+        if (fp) {
+          fclose (fp);
+        }
+        return -EXIT_FAILURE;
+      }
+      stream_add (s, data_sent);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &s->end);
   }
 
-  printf ("Data sent. Terminating...\n");
   shutdown (sock, SHUT_RDWR);
   close (sock);
   free (buffer);
-  fclose (fp);
+  if (fp) {
+    fclose (fp);
+  }
   return 0;
 }
 
-int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+static int
+client_microtcp (stream_t *s)
 {
-  /*TODO: Write your code here */
-  FILE* fp;
-  uint8_t* buffer;
-  size_t read_items = 0;
+  run_t *run = s->run;
+  int fd = -1;
+  off_t offset = 0;
+  uint8_t *buffer;
+  size_t read_items;
   ssize_t data_sent;
   microtcp_sock_t socket;
-  int domain=AF_INET;
-  int type=SOCK_DGRAM;
-  int protocol=0;
-  socket=microtcp_socket(domain,type,protocol);
-  struct sockaddr_in servaddr ;
-  memset(&servaddr, 0, sizeof(struct sockaddr_in));
+  struct sockaddr_in servaddr;
+
+  socket = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  memset (&servaddr, 0, sizeof(struct sockaddr_in));
   servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = inet_addr(serverip);
-  servaddr.sin_port = htons(server_port);
-  if (microtcp_connect(&socket,(struct sockaddr *) &servaddr, sizeof(struct sockaddr_in))) {
-      printf("connection with the server failed...\n");
-      exit(0);
+  servaddr.sin_addr.s_addr = inet_addr (run->serverip);
+  servaddr.sin_port = htons (run->port + s->id);
+  if (trace_file && s->id == 0) {
+    microtcp_setsockopt (&socket, MICROTCP_TRACE, TRACE_EVENTS);
   }
-  printf("TCP Connection Established\n");
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
-  if (!buffer) {
-    perror ("Allocate application receive buffer");
+  if (fec_block > 0) {
+    microtcp_setsockopt (&socket, MICROTCP_FEC, fec_block);
+  }
+  if (compress) {
+    microtcp_setsockopt (&socket, MICROTCP_COMPRESS, 1);
+  }
+  if (microtcp_connect (&socket, (struct sockaddr *) &servaddr,
+                        sizeof(struct sockaddr_in))) {
+    printf ("connection with the server failed...\n");
     return -EXIT_FAILURE;
   }
-  /* Open and read the file that will be transmitted */
-  fp = fopen (file, "r");
-  if (!fp) {
-    perror ("Open file for reading");
-    free (buffer);
+  /* Allocate memory for the application send buffer */
+  buffer = (uint8_t *) calloc (1, run->write_size);
+  if (!buffer) {
+    perror ("Allocate application send buffer");
     return -EXIT_FAILURE;
   }
-  printf ("Starting sending data...\n");
-  /* Start sending the data */
-  while (!feof (fp)) {
-    read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1) {
-      perror ("Failed read from file");
-      microtcp_shutdown (&socket, SHUT_RDWR);
-      close (socket.sd);
+  /* The file that will be transmitted, microTCP sends it from its mapping */
+  if (run->file) {
+    fd = open (run->file, O_RDONLY);
+    if (fd == -1) {
+      perror ("Open file for reading");
       free (buffer);
-      fclose (fp);
       return -EXIT_FAILURE;
     }
-    data_sent = microtcp_send (&socket, buffer, read_items * sizeof(uint8_t), 0);
-    if ((size_t)data_sent != read_items * sizeof(uint8_t)) {
+  }
+
+  stream_started (s);
+  /* Start sending the data */
+  for (;;) {
+    if (fd != -1) {
+      read_items = FILE_STEP;
+      data_sent = microtcp_sendfile (&socket, fd, offset, read_items);
+      if (data_sent == 0) {
+        break;
+      }
+      offset += (data_sent > 0) ? data_sent : 0;
+    }
+    else if (stream_done (s)) {
+      break;
+    }
+    else {
+      read_items = run->write_size;
+      data_sent = microtcp_send (&socket, buffer, read_items, 0);
+    }
+    if (data_sent < 0 || (fd == -1 && (size_t) data_sent != read_items)) {
       printf ("Failed to send the"
               " amount of data read from the file.\n");
-      microtcp_shutdown(&socket, SHUT_RDWR);
+      microtcp_shutdown (&socket, SHUT_RDWR);
       close (socket.sd);
       free (buffer);
-      fclose (fp);
+      if (fd != -1) {
+        close (fd);
+      }
       return -EXIT_FAILURE;
     }
+    stream_add (s, data_sent);
+    clock_gettime (CLOCK_MONOTONIC, &s->end);
   }
-  printf ("Data sent. Terminating...\n");
-  microtcp_shutdown(&socket, SHUT_RDWR);
+  microtcp_shutdown (&socket, SHUT_RDWR);
+  microtcp_get_stats (&socket, &s->stats);
+  s->has_stats = 1;
+  save_trace (s, &socket);
   close (socket.sd);
   free (buffer);
-  fclose (fp);
+  if (fd != -1) {
+    close (fd);
+  }
+  return 0;
+}
+
+static void *
+stream_thread (void *arg)
+{
+  stream_t *s = (stream_t *) arg;
+  run_t *run = s->run;
+
+  if (run->is_server) {
+    s->result = run->use_microtcp ? server_microtcp (s) : server_tcp (s);
+  }
+  else {
+    s->result = run->use_microtcp ? client_microtcp (s) : client_tcp (s);
+  }
+  __atomic_fetch_sub (&run->active, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
+static const char *
+protocol_name (const run_t *run)
+{
+  return run->use_microtcp ? "microtcp" : "tcp";
+}
+
+static uint64_t
+run_bytes (run_t *run)
+{
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < run->nstreams; i++) {
+    total += __atomic_load_n (&run->streams[i].bytes, __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/* Duration of the run, from the first connection to the last byte moved */
+static double
+run_seconds (const run_t *run)
+{
+  double seconds = 0;
+  double end;
+  int i;
+  for (i = 0; i < run->nstreams; i++) {
+    end = elapsed_s (run->start, run->streams[i].end);
+    if (end > seconds) {
+      seconds = end;
+    }
+  }
+  return seconds;
+}
+
+static double
+mbit_per_s (uint64_t bytes, double seconds)
+{
+  return seconds > 0 ? bytes * 8 / seconds / 1e6 : 0;
+}
+
+static int
+run_start (run_t *run)
+{
+  int i;
+
+  run->active = run->nstreams;
+  for (i = 0; i < run->nstreams; i++) {
+    run->streams[i].run = run;
+    run->streams[i].id = i;
+    if (pthread_create (&run->threads[i], NULL, stream_thread,
+                        &run->streams[i]) != 0) {
+      perror ("Starting stream thread");
+      return -1;
+    }
+  }
   return 0;
 }
 
+static void
+run_report (run_t *run)
+{
+  struct timespec now;
+  interval_t *iv;
+  interval_t *grown;
+  uint64_t bytes;
+  double t;
+  int done;
+
+  pthread_mutex_lock (&run->lock);
+  if (!interval || !run->started || run->reports_done) {
+    pthread_mutex_unlock (&run->lock);
+    return;
+  }
+  pthread_mutex_unlock (&run->lock);
+  done = __atomic_load_n (&run->active, __ATOMIC_ACQUIRE) == 0;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  t = elapsed_s (run->start, now);
+  if (t < run->next_report && !done) {
+    return;
+  }
+  bytes = run_bytes (run);
+  if (done) {
+    /* The last interval ends with the last byte moved */
+    run->reports_done = 1;
+    t = run_seconds (run);
+    if (bytes == run->reported_bytes) {
+      return;
+    }
+  }
+
+  grown = realloc (run->intervals, (run->nintervals + 1) * sizeof(interval_t));
+  if (!grown) {
+    return;
+  }
+  run->intervals = grown;
+  iv = &run->intervals[run->nintervals++];
+  iv->start = run->next_report - interval;
+  iv->end = t;
+  iv->bytes = bytes - run->reported_bytes;
+  run->reported_bytes = bytes;
+  run->next_report += interval;
+  if (!json) {
+    printf ("[%-8s] %7.2f-%7.2f sec %10.2f MB %10.2f Mbit/s\n",
+            protocol_name (run), iv->start, iv->end,
+            iv->bytes / (1024.0 * 1024.0),
+            mbit_per_s (iv->bytes, iv->end - iv->start));
+    fflush (stdout);
+  }
+}
+
+/* Reports intervals until all streams of the runs are done, then collects them */
+static int
+run_wait (run_t *runs, int nruns)
+{
+  int exit_code = 0;
+  int active;
+  int i;
+  int j;
+
+  do {
+    usleep (10000);
+    active = 0;
+    for (i = 0; i < nruns; i++) {
+      active += __atomic_load_n (&runs[i].active, __ATOMIC_ACQUIRE);
+      run_report (&runs[i]);
+    }
+  }
+  while (active > 0);
+
+  for (i = 0; i < nruns; i++) {
+    for (j = 0; j < runs[i].nstreams; j++) {
+      pthread_join (runs[i].threads[j], NULL);
+      if (runs[i].streams[j].result != 0) {
+        exit_code = runs[i].streams[j].result;
+      }
+    }
+  }
+  return exit_code;
+}
+
+static void
+print_run (run_t *run)
+{
+  stream_t *s;
+  uint64_t total = run_bytes (run);
+  struct timespec end = run->start;
+  int i;
+
+  printf ("%s results:\n", run->use_microtcp ? "microTCP" : "TCP");
+  for (i = 0; i < run->nstreams; i++) {
+    s = &run->streams[i];
+    printf ("  stream %2d: %10.2f MB %10.2f Mbit/s", i,
+            s->bytes / (1024.0 * 1024.0),
+            mbit_per_s (s->bytes, elapsed_s (s->start, s->end)));
+    if (s->has_stats) {
+      printf (", retransmits %llu, timeouts %llu, srtt %u us",
+              (unsigned long long) s->stats.retransmits,
+              (unsigned long long) s->stats.timeouts, s->stats.srtt_us);
+      if (s->stats.fec_repairs) {
+        printf (", FEC repairs %llu",
+                (unsigned long long) s->stats.fec_repairs);
+      }
+      if (s->stats.bytes_saved) {
+        printf (", compression saved %.2f MB",
+                s->stats.bytes_saved / (1024.0 * 1024.0));
+      }
+    }
+    printf ("\n");
+    if (elapsed_s (end, s->end) > 0) {
+      end = s->end;
+    }
+  }
+  print_statistics (total, run->start, end);
+}
+
+static void
+print_json_run (run_t *run)
+{
+  stream_t *s;
+  uint64_t total = run_bytes (run);
+  double seconds = run_seconds (run);
+  size_t i;
+
+  printf ("    {\n      \"protocol\": \"%s\",\n", protocol_name (run));
+  printf ("      \"bytes\": %llu,\n      \"seconds\": %.6f,\n"
+          "      \"mbit_per_s\": %.3f,\n",
+          (unsigned long long) total, seconds, mbit_per_s (total, seconds));
+  printf ("      \"streams\": [");
+  for (i = 0; i < (size_t) run->nstreams; i++) {
+    s = &run->streams[i];
+    printf ("%s\n        {\"id\": %zu, \"bytes\": %llu, \"mbit_per_s\": %.3f",
+            i ? "," : "", i, (unsigned long long) s->bytes,
+            mbit_per_s (s->bytes, elapsed_s (s->start, s->end)));
+    if (s->has_stats) {
+      printf (", \"packets_sent\": %llu, \"retransmits\": %llu,"
+              " \"timeouts\": %llu, \"dup_acks\": %llu, \"fec_repairs\": %llu,"
+              " \"bytes_saved\": %llu,"
+              " \"rtt_min_us\": %u, \"rtt_avg_us\": %u, \"rtt_p99_us\": %u",
+              (unsigned long long) s->stats.packets_send,
+              (unsigned long long) s->stats.retransmits,
+              (unsigned long long) s->stats.timeouts,
+              (unsigned long long) s->stats.dup_acks,
+              (unsigned long long) s->stats.fec_repairs,
+              (unsigned long long) s->stats.bytes_saved, s->stats.rtt_min_us,
+              s->stats.rtt_avg_us, s->stats.rtt_p99_us);
+    }
+    printf ("}");
+  }
+  printf ("\n      ],\n      \"intervals\": [");
+  for (i = 0; i < run->nintervals; i++) {
+    printf ("%s\n        {\"start\": %.3f, \"end\": %.3f, \"bytes\": %llu,"
+            " \"mbit_per_s\": %.3f}", i ? "," : "", run->intervals[i].start,
+            run->intervals[i].end,
+            (unsigned long long) run->intervals[i].bytes,
+            mbit_per_s (run->intervals[i].bytes,
+                        run->intervals[i].end - run->intervals[i].start));
+  }
+  printf ("%s]\n    }", run->nintervals ? "\n      " : "");
+}
+
+static void
+print_json (run_t *runs, int nruns)
+{
+  int i;
+
+  printf ("{\n  \"role\": \"%s\",\n  \"streams\": %d,\n  \"write_size\": %zu,\n",
+          runs[0].is_server ? "server" : "client", runs[0].nstreams,
+          runs[0].write_size);
+  if (!runs[0].is_server && !runs[0].file) {
+    printf ("  \"duration\": %.3f,\n", runs[0].duration);
+  }
+  printf ("  \"results\": [\n");
+  for (i = 0; i < nruns; i++) {
+    print_json_run (&runs[i]);
+    printf ("%s\n", i + 1 < nruns ? "," : "");
+  }
+  printf ("  ]");
+  if (nruns == 2) {
+    /* runs[0] is TCP and runs[1] microTCP */
+    double tcp = mbit_per_s (run_bytes (&runs[0]), run_seconds (&runs[0]));
+    double utcp = mbit_per_s (run_bytes (&runs[1]), run_seconds (&runs[1]));
+    printf (",\n  \"microtcp_vs_tcp\": %.4f", tcp > 0 ? utcp / tcp : 0);
+  }
+  printf ("\n}\n");
+}
+
 int
 main (int argc, char **argv)
 {
   int opt;
-  int port;
+  int port = 0;
   int exit_code = 0;
   char *filestr = NULL;
   char *ipstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  uint8_t compare = 0;
+  int nstreams = 1;
+  size_t write_size = CHUNK_SIZE;
+  double duration = 0;
+  run_t runs[2];
+  int nruns;
+  int i;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmbf:p:a:t:n:d:w:i:JF:zZ")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -398,61 +825,145 @@ main (int argc, char **argv)
       case 'm':
         use_microtcp = 1;
         break;
+      case 'b':
+        compare = 1;
+        break;
       case 'f':
         filestr = strdup (optarg);
-        /* A few checks will be nice here...*/
-        /* Convert the given file to absolute path */
         break;
       case 'p':
         port = atoi (optarg);
-        /* To check or not to check? */
         break;
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 't':
+        trace_file = optarg;
+        break;
+      case 'n':
+        nstreams = atoi (optarg);
+        break;
+      case 'd':
+        duration = atof (optarg);
+        break;
+      case 'w':
+        write_size = strtoul (optarg, NULL, 10);
+        break;
+      case 'i':
+        interval = atof (optarg);
+        break;
+      case 'J':
+        json = 1;
+        break;
+      case 'F':
+        fec_block = atoi (optarg);
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case 'Z':
+        zero_copy = 1;
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m | -b] -p port [-f file] [options]\n"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -b                  Run over both TCP and microTCP and compare them. The client runs TCP first.\n"
             "   -f <string>         If -s is set the -f option specifies the filename of the file that will be saved.\n"
             "                       If not, is the source file at the client side that will be sent to the server.\n"
-            "   -p <int>            The listening port of the server\n"
+            "                       Without -f data goes from memory to memory.\n"
+            "   -p <int>            The listening port of the server, stream i uses port + i\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -n <int>            Number of parallel streams (default 1)\n"
+            "   -d <float>          Seconds to send for without -f (default 10)\n"
+            "   -w <int>            Bytes per write and read (default 4096)\n"
+            "   -i <float>          Seconds between interval reports\n"
+            "   -J                  Print the results as JSON\n"
+            "   -t <string>         Save the microTCP event trace of the first stream to this file, see trace_dump.\n"
+            "   -F <int>            Send a microTCP FEC parity segment every <int> data segments, both ends need it.\n"
+            "   -z                  Compress the microTCP payload, both ends need it.\n"
+            "   -Z                  Without -f, the microTCP server receives without copying the data.\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
   }
 
-  /*
-   * TODO: Some error checking here???
-   */
+  if (port <= 0 || (!is_server && !ipstr)) {
+    fprintf (stderr, "A port and, for the client, a server address are required\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nstreams < 1 || nstreams > MAX_STREAMS) {
+    fprintf (stderr, "The number of streams must be in [1, %d]\n", MAX_STREAMS);
+    exit (EXIT_FAILURE);
+  }
+  if (filestr && (nstreams > 1 || compare)) {
+    fprintf (stderr, "A file can only be moved over a single stream of one protocol\n");
+    exit (EXIT_FAILURE);
+  }
+  if (write_size == 0) {
+    fprintf (stderr, "The write size must be positive\n");
+    exit (EXIT_FAILURE);
+  }
+  if (!filestr && duration <= 0) {
+    duration = DEFAULT_DURATION;
+  }
+
+  nruns = compare ? 2 : 1;
+  memset (runs, 0, sizeof(runs));
+  for (i = 0; i < nruns; i++) {
+    runs[i].use_microtcp = compare ? i : use_microtcp;
+    runs[i].is_server = is_server;
+    runs[i].serverip = ipstr;
+    runs[i].port = port;
+    runs[i].nstreams = nstreams;
+    runs[i].file = filestr;
+    runs[i].write_size = write_size;
+    runs[i].duration = duration;
+    pthread_mutex_init (&runs[i].lock, NULL);
+  }
 
   /*
-   * Depending the use arguments execute the appropriate functions
+   * A server listens on both protocols at once, a client measures them
+   * one after the other so they do not compete for the path.
    */
   if (is_server) {
-
-    if (use_microtcp) {
-      exit_code = server_microtcp (port, filestr);
-    }
-    else {
-      exit_code = server_tcp (port, filestr);
+    for (i = 0; i < nruns; i++) {
+      if (run_start (&runs[i]) == -1) {
+        exit (EXIT_FAILURE);
+      }
     }
+    exit_code = run_wait (runs, nruns);
   }
   else {
-    if (use_microtcp) {
-      exit_code = client_microtcp (ipstr, port, filestr);
+    for (i = 0; i < nruns && exit_code == 0; i++) {
+      if (!json) {
+        printf ("Starting sending data over %s...\n",
+                runs[i].use_microtcp ? "microTCP" : "TCP");
+      }
+      if (run_start (&runs[i]) == -1) {
+        exit (EXIT_FAILURE);
+      }
+      exit_code = run_wait (&runs[i], 1);
     }
-    else {
-      exit_code = client_tcp (ipstr, port, filestr);
+  }
+
+  if (json) {
+    print_json (runs, nruns);
+  }
+  else {
+    for (i = 0; i < nruns; i++) {
+      print_run (&runs[i]);
     }
   }
 
+  for (i = 0; i < nruns; i++) {
+    free (runs[i].intervals);
+    pthread_mutex_destroy (&runs[i].lock);
+  }
   free (filestr);
   free (ipstr);
   return exit_code;
 }
-
@@ -0,0 +1,161 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Data held by MSG_MORE must not tie the socket to the thread that sent
+ * it. A thread sends with MSG_MORE and exits, a second one sends past
+ * MICROTCP_CORK_US, and the main thread shuts the connection down. The
+ * server checks that all of it arrived, in order.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+static const char expected[] = "held by the first thread, then by the second";
+
+typedef struct
+{
+  microtcp_sock_t *sock;
+  const char *data;
+  size_t len;
+  ssize_t result;
+} send_job_t;
+
+typedef struct
+{
+  microtcp_sock_t sock;
+  char buf[256];
+  size_t len;
+  int result;
+} server_t;
+
+static void *
+send_thread (void *arg)
+{
+  send_job_t *job = (send_job_t *) arg;
+  job->result = microtcp_send (job->sock, job->data, job->len, MSG_MORE);
+  return NULL;
+}
+
+static void *
+server_thread (void *arg)
+{
+  server_t *server = (server_t *) arg;
+  struct sockaddr_in peer;
+  ssize_t received;
+
+  server->result = -1;
+  if (microtcp_accept (&server->sock, (struct sockaddr *) &peer,
+                       sizeof (peer)) == -1) {
+    return NULL;
+  }
+  while ((received = microtcp_recv (&server->sock,
+                                    server->buf + server->len,
+                                    sizeof (server->buf) - server->len,
+                                    0)) > 0) {
+    server->len += received;
+  }
+  microtcp_shutdown (&server->sock, 0);
+  server->result = 0;
+  return NULL;
+}
+
+static int
+run_sender (microtcp_sock_t *sock, const char *data, size_t len)
+{
+  pthread_t thread;
+  send_job_t job;
+
+  job.sock = sock;
+  job.data = data;
+  job.len = len;
+  if (pthread_create (&thread, NULL, send_thread, &job) != 0) {
+    perror ("pthread_create");
+    return -1;
+  }
+  /* The thread is gone, and its timer wheel with it, before the next call */
+  pthread_join (thread, NULL);
+  return (job.result == (ssize_t) len) ? 0 : -1;
+}
+
+int
+main (void)
+{
+  static server_t server;
+  microtcp_sock_t client;
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof (sin);
+  pthread_t thread;
+  size_t first = 24;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = 0;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  server.sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (microtcp_bind (&server.sock, (struct sockaddr *) &sin, sizeof (sin)) == -1
+      || getsockname (server.sock.sd, (struct sockaddr *) &sin, &sin_len) == -1) {
+    perror ("bind");
+    return EXIT_FAILURE;
+  }
+  if (pthread_create (&thread, NULL, server_thread, &server) != 0) {
+    perror ("pthread_create");
+    return EXIT_FAILURE;
+  }
+
+  client = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (microtcp_connect (&client, (struct sockaddr *) &sin, sizeof (sin)) == -1) {
+    fprintf (stderr, "Cannot connect\n");
+    return EXIT_FAILURE;
+  }
+  if (run_sender (&client, expected, first) == -1) {
+    fprintf (stderr, "First held send failed\n");
+    return EXIT_FAILURE;
+  }
+  usleep (MICROTCP_CORK_US + 50000);
+  if (run_sender (&client, expected + first, strlen (expected) - first) == -1) {
+    fprintf (stderr, "Second held send failed\n");
+    return EXIT_FAILURE;
+  }
+  if (microtcp_shutdown (&client, 0) == -1) {
+    perror ("microtcp_shutdown");
+    return EXIT_FAILURE;
+  }
+  pthread_join (thread, NULL);
+  close (client.sd);
+  close (server.sock.sd);
+
+  if (server.result == -1 || server.len != strlen (expected)
+      || memcmp (server.buf, expected, server.len) != 0) {
+    fprintf (stderr, "Server got %zu bytes: %.*s\n", server.len,
+             (int) server.len, server.buf);
+    return EXIT_FAILURE;
+  }
+  printf ("Server got all %zu bytes\n", server.len);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the per-packet hot paths: CRC-32, header conversion,
+ * building a data segment, sending it, validating a received one,
+ * compressing and decompressing a payload, and moving a timer among many
+ * pending ones.
+ * Reports ns/op and GB/s of payload per payload size, as a table or as
+ * JSON (-j) with a fixed layout so runs can be compared by scripts.
+ *
+ * The library source is included directly so the static helpers of
+ * microtcp_send()/microtcp_recv() are measured as they are, without
+ * exporting them. Configure with -DCMAKE_BUILD_TYPE=Release for numbers
+ * that mean something.
+ */
+
+#include "../lib/microtcp.c"
+
+#include <unistd.h>
+
+typedef struct
+{
+  const char *name;
+  int sized;                    /* Runs once per payload size, otherwise once */
+  void (*run) (size_t size, uint64_t iterations);
+} bench_t;
+
+static const size_t sizes[] = { 64, 512, 1400, 4096, 16384 };
+
+static volatile uint32_t sink;
+static uint8_t payload[MICROTCP_MAX_MSS];
+static uint8_t datagram[MICROTCP_MAX_MSS];
+static microtcp_sock_t sock;
+static microtcp_segment_t seg;
+
+static void
+bench_crc32 (size_t size, uint64_t iterations)
+{
+  uint32_t crc = 0;
+  uint64_t i;
+  for (i = 0; i < iterations; i++) {
+    crc = update_crc32 (crc, payload, size);
+  }
+  sink = crc;
+}
+
+static void
+bench_header (size_t size, uint64_t iterations)
+{
+  microtcp_header_t header;
+  uint64_t i;
+  (void) size;
+  for (i = 0; i < iterations; i++) {
+    header = reverse (create_header (i, ACK, 1400, i + 1, 65535));
+    sink = header.seq_number;
+  }
+}
+
+static void
+bench_segment_build (size_t size, uint64_t iterations)
+{
+  microtcp_header_t header;
+  uint64_t i;
+  seg.data_len = size;
+  for (i = 0; i < iterations; i++) {
+    seg.seq_end = i;
+    header = segment_header (&sock, &seg, seg.data, size);
+    sink = header.checksum;
+  }
+}
+
+static void
+bench_segment_send (size_t size, uint64_t iterations)
+{
+  uint64_t i;
+  seg.data_len = size;
+  for (i = 0; i < iterations; i++) {
+    seg.seq_end = i;
+    transmit_segment (&sock, &seg);
+  }
+}
+
+static void
+bench_recv_validate (size_t size, uint64_t iterations)
+{
+  microtcp_header_t header;
+  uint64_t i;
+  seg.data_len = size;
+  header = segment_header (&sock, &seg, seg.data, size);
+  memcpy (datagram, &header, sizeof(microtcp_header_t));
+  memcpy (datagram + sizeof(microtcp_header_t), payload, size);
+  for (i = 0; i < iterations; i++) {
+    if (parse_segment (datagram, sizeof(microtcp_header_t) + size, &header) == -1) {
+      fprintf (stderr, "Benchmark segment failed validation\n");
+      exit (EXIT_FAILURE);
+    }
+    sink = header.data_len;
+  }
+}
+
+static void
+bench_lz_compress (size_t size, uint64_t iterations)
+{
+  static uint8_t out[MICROTCP_MAX_MSS];
+  size_t len;
+  uint64_t i;
+  for (i = 0; i < iterations; i++) {
+    len = size;
+    sink = lz_compress (payload, &len, out, sizeof(out));
+  }
+}
+
+static void
+bench_lz_decompress (size_t size, uint64_t iterations)
+{
+  static uint8_t block[MICROTCP_MAX_MSS];
+  static uint8_t out[MICROTCP_MAX_MSS];
+  size_t len = size;
+  size_t zlen;
+  uint64_t i;
+  zlen = lz_compress (payload, &len, block, sizeof(block));
+  for (i = 0; i < iterations; i++) {
+    sink = lz_decompress (block, zlen, out, sizeof(out));
+  }
+}
+
+#define BENCH_TIMERS 100000
+#define BENCH_TIMER_SPAN ((uint64_t) BENCH_TIMERS * MICROTCP_TIMER_TICK_US)
+
+static timer_wheel_t wheel;
+static timer_entry_t *timers;
+
+static void
+bench_timer_fired (timer_entry_t *t)
+{
+  (void) t;
+  sink++;
+}
+
+/*
+ * Re-arms one of BENCH_TIMERS pending timers per operation, as every ACK
+ * moves a retransmission timer, and advances the wheel by a tick so the
+ * upper levels keep cascading.
+ */
+static void
+bench_timer_rearm (size_t size, uint64_t iterations)
+{
+  uint64_t now;
+  uint64_t i;
+  size_t j;
+  (void) size;
+  if (timers == NULL) {
+    timers = malloc (BENCH_TIMERS * sizeof(timer_entry_t));
+    timer_wheel_init (&wheel, MICROTCP_TIMER_TICK_US, 0);
+    for (j = 0; j < BENCH_TIMERS; j++) {
+      timer_init (&timers[j], bench_timer_fired, NULL);
+      timer_wheel_add (&wheel, &timers[j], BENCH_TIMER_SPAN + (j * 7919) % BENCH_TIMER_SPAN);
+    }
+  }
+  now = wheel.now * wheel.tick_us;
+  for (i = 0; i < iterations; i++) {
+    j = i % BENCH_TIMERS;
+    timer_wheel_add (&wheel, &timers[j], now + BENCH_TIMER_SPAN + (j * 7919) % BENCH_TIMER_SPAN);
+    now += MICROTCP_TIMER_TICK_US;
+    timer_wheel_advance (&wheel, now);
+  }
+}
+
+static const bench_t benchmarks[] = {
+  { "update_crc32", 1, bench_crc32 },
+  { "create_header_reverse", 0, bench_header },
+  { "segment_build", 1, bench_segment_build },
+  { "segment_send", 1, bench_segment_send },
+  { "recv_validate", 1, bench_recv_validate },
+  { "lz_compress", 1, bench_lz_compress },
+  { "lz_decompress", 1, bench_lz_decompress },
+  { "timer_rearm_100k", 0, bench_timer_rearm },
+};
+
+static double
+elapsed_s (struct timespec start, struct timespec end)
+{
+  return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/* Doubles the iteration count until a run lasts at least min_time */
+static void
+measure (const bench_t *b, size_t size, double min_time, int json,
+         int *first)
+{
+  struct timespec start;
+  struct timespec end;
+  uint64_t iterations = 1;
+  double elapsed;
+  double ns_per_op;
+  double gb_per_s;
+
+  b->run (size, 1);
+  for (;;) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    b->run (size, iterations);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    elapsed = elapsed_s (start, end);
+    if (elapsed >= min_time) {
+      break;
+    }
+    iterations *= (elapsed > min_time / 64) ? 2 : 16;
+  }
+  ns_per_op = elapsed * 1e9 / iterations;
+  gb_per_s = (double) size * iterations / elapsed / 1e9;
+
+  if (json) {
+    printf ("%s    {\"name\": \"%s\", \"size\": %zu, \"iterations\": %llu,"
+            " \"ns_per_op\": %.3f, \"gb_per_s\": %.4f}",
+            *first ? "" : ",\n", b->name, size,
+            (unsigned long long) iterations, ns_per_op, gb_per_s);
+  }
+  else {
+    printf ("%-24s %8zu %14.2f %10.3f\n", b->name, size, ns_per_op, gb_per_s);
+  }
+  *first = 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(struct sockaddr_in);
+  double min_time = 0.2;
+  const char *filter = NULL;
+  int json = 0;
+  int first = 1;
+  int sink_sd;
+  int opt;
+  size_t i;
+  size_t j;
+
+  while ((opt = getopt (argc, argv, "hjt:f:")) != -1) {
+    switch (opt)
+      {
+      case 'j':
+        json = 1;
+        break;
+      case 't':
+        min_time = atof (optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      default:
+        printf (
+            "Usage: microtcp_bench [-j] [-t seconds] [-f name]\n"
+            "Options:\n"
+            "   -j                  Print the results as JSON\n"
+            "   -t <float>          Minimum duration of each measurement, default 0.2\n"
+            "   -f <string>         Run only the benchmarks whose name contains the string\n"
+            "   -h                  prints this help\n");
+        exit (EXIT_FAILURE);
+      }
+  }
+
+  for (i = 0; i < sizeof(payload); i++) {
+    payload[i] = (uint8_t) (i * 131 + 7);
+  }
+
+  /* Segments go to a local UDP socket that is never read, the kernel drops them */
+  sink_sd = socket (AF_INET, SOCK_DGRAM, 0);
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (sink_sd == -1
+      || bind (sink_sd, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+      || getsockname (sink_sd, (struct sockaddr *) &sin, &sin_len) == -1) {
+    perror ("Opening the sink socket");
+    exit (EXIT_FAILURE);
+  }
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  sock.address = (struct sockaddr *) &sin;
+  sock.address_len = sizeof(struct sockaddr_in);
+  seg.data = payload;
+
+  if (json) {
+    printf ("{\n  \"benchmarks\": [\n");
+  }
+  else {
+    printf ("%-24s %8s %14s %10s\n", "benchmark", "size", "ns/op", "GB/s");
+  }
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    if (filter && !strstr (benchmarks[i].name, filter)) {
+      continue;
+    }
+    if (!benchmarks[i].sized) {
+      measure (&benchmarks[i], 0, min_time, json, &first);
+      continue;
+    }
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+      measure (&benchmarks[i], sizes[j], min_time, json, &first);
+    }
+  }
+  if (json) {
+    printf ("\n  ]\n}\n");
+  }
+
+  close (sock.sd);
+  close (sink_sd);
+  return 0;
+}
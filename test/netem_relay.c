@@ -0,0 +1,490 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Userspace network impairment emulator. It relays UDP datagrams between a
+ * microTCP client and server and applies delay, jitter, random and bursty
+ * loss, reordering, duplication and a bandwidth cap to both directions, so
+ * the library can be benchmarked under lossy, slow links on one machine.
+ *
+ * The client connects to the relay port instead of the server. All random
+ * decisions come from a seeded generator, so a run can be repeated exactly
+ * given the same seed and packet arrival order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_DATAGRAM 65536
+
+/* Directions of the relay */
+#define TO_SERVER 0
+#define TO_CLIENT 1
+
+typedef struct
+{
+  double delay_ms;              /* Constant one way delay */
+  double jitter_ms;             /* Uniform variation of the delay, +- */
+  double loss;                  /* Probability of random loss */
+  double burst_enter;           /* Gilbert-Elliott: probability good -> bad */
+  double burst_exit;            /* Gilbert-Elliott: probability bad -> good */
+  double reorder;               /* Probability a packet skips the delay queue */
+  double duplicate;             /* Probability a packet is sent twice */
+  double rate_bps;              /* Bandwidth cap in bits/s, 0 for unlimited */
+  size_t queue_limit;           /* Packets waiting per direction before tail drop */
+} impairment_t;
+
+typedef struct
+{
+  uint64_t forwarded;
+  uint64_t lost;
+  uint64_t burst_lost;
+  uint64_t queue_drops;
+  uint64_t duplicated;
+  uint64_t reordered;
+} relay_stats_t;
+
+typedef struct
+{
+  uint64_t departure_us;
+  uint64_t order;               /* Keeps FIFO order among equal departures */
+  int direction;
+  size_t len;
+  uint8_t *data;
+} pending_t;
+
+static volatile sig_atomic_t running = 1;
+static uint64_t rng_state;
+
+/* Min-heap of pending packets ordered by departure time */
+static pending_t *heap;
+static size_t heap_len;
+static size_t heap_cap;
+static uint64_t heap_order;
+
+static void
+sig_handler (int signal)
+{
+  if (signal == SIGINT || signal == SIGTERM) {
+    running = 0;
+  }
+}
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, deterministic for a given seed */
+static double
+rng_uniform (void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+heap_before (const pending_t *a, const pending_t *b)
+{
+  if (a->departure_us != b->departure_us) {
+    return a->departure_us < b->departure_us;
+  }
+  return a->order < b->order;
+}
+
+static int
+heap_push (uint64_t departure_us, int direction, const uint8_t *data,
+           size_t len)
+{
+  pending_t p;
+  pending_t tmp;
+  size_t i;
+
+  if (heap_len == heap_cap) {
+    size_t cap = heap_cap ? heap_cap * 2 : 256;
+    pending_t *h = realloc (heap, cap * sizeof(pending_t));
+    if (!h) {
+      perror ("Growing the delay queue");
+      return -1;
+    }
+    heap = h;
+    heap_cap = cap;
+  }
+  p.departure_us = departure_us;
+  p.order = heap_order++;
+  p.direction = direction;
+  p.len = len;
+  p.data = malloc (len);
+  if (!p.data) {
+    perror ("Allocating a delayed packet");
+    return -1;
+  }
+  memcpy (p.data, data, len);
+
+  i = heap_len++;
+  heap[i] = p;
+  while (i > 0 && heap_before (&heap[i], &heap[(i - 1) / 2])) {
+    tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+  return 0;
+}
+
+static pending_t
+heap_pop (void)
+{
+  pending_t top = heap[0];
+  pending_t tmp;
+  size_t i = 0;
+  size_t child;
+
+  heap[0] = heap[--heap_len];
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= heap_len) {
+      break;
+    }
+    if (child + 1 < heap_len && heap_before (&heap[child + 1], &heap[child])) {
+      child++;
+    }
+    if (!heap_before (&heap[child], &heap[i])) {
+      break;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+  return top;
+}
+
+/*
+ * Decides the fate of a datagram arriving for one direction and queues the
+ * copies that survive.
+ */
+static void
+impair (const impairment_t *imp, int *bad_state, uint64_t *link_free_us,
+        size_t *queued, relay_stats_t *stats, int direction,
+        const uint8_t *data, size_t len)
+{
+  uint64_t now = now_us ();
+  uint64_t ready;
+  uint64_t departure;
+  double delay;
+  int copies = 1;
+  int i;
+
+  /* Two state Gilbert-Elliott model, every packet is lost in the bad state */
+  if (imp->burst_enter > 0) {
+    if (*bad_state) {
+      *bad_state = rng_uniform () >= imp->burst_exit;
+    }
+    else {
+      *bad_state = rng_uniform () < imp->burst_enter;
+    }
+    if (*bad_state) {
+      stats->burst_lost++;
+      return;
+    }
+  }
+  if (rng_uniform () < imp->loss) {
+    stats->lost++;
+    return;
+  }
+  if (rng_uniform () < imp->duplicate) {
+    stats->duplicated++;
+    copies = 2;
+  }
+
+  for (i = 0; i < copies; i++) {
+    if (*queued >= imp->queue_limit) {
+      stats->queue_drops++;
+      return;
+    }
+    delay = imp->delay_ms;
+    if (imp->jitter_ms > 0) {
+      delay += (2 * rng_uniform () - 1) * imp->jitter_ms;
+    }
+    if (imp->reorder > 0 && rng_uniform () < imp->reorder) {
+      /* Jump ahead of the packets still waiting out their delay */
+      stats->reordered++;
+      delay = 0;
+    }
+    ready = now + (delay > 0 ? (uint64_t) (delay * 1000) : 0);
+    departure = ready;
+    if (imp->rate_bps > 0) {
+      /* Serialize on the bottleneck link, packets queue behind each other */
+      if (*link_free_us > departure) {
+        departure = *link_free_us;
+      }
+      *link_free_us = departure + (uint64_t) (len * 8 * 1e6 / imp->rate_bps);
+    }
+    if (heap_push (departure, direction, data, len) == 0) {
+      (*queued)++;
+    }
+  }
+}
+
+static void
+print_stats (const char *name, const relay_stats_t *s)
+{
+  printf ("%s: forwarded %llu, lost %llu, burst lost %llu, queue drops %llu,"
+          " duplicated %llu, reordered %llu\n", name,
+          (unsigned long long) s->forwarded, (unsigned long long) s->lost,
+          (unsigned long long) s->burst_lost,
+          (unsigned long long) s->queue_drops,
+          (unsigned long long) s->duplicated,
+          (unsigned long long) s->reordered);
+}
+
+static void
+usage (void)
+{
+  printf (
+      "Usage: netem_relay -l port -a server_ip -p server_port [options]\n"
+      "Options:\n"
+      "   -l <int>            The port the relay listens to for the client\n"
+      "   -a <string>         The IP address of the server\n"
+      "   -p <int>            The port of the server\n"
+      "   -d <float>          One way delay in ms\n"
+      "   -j <float>          Jitter in ms, the delay varies uniformly by +- this amount\n"
+      "   -L <float>          Random loss in percent\n"
+      "   -g <float:float>    Burst loss, percent chance to enter and to leave the loss state\n"
+      "   -r <float>          Percent of packets that skip the delay and get ahead of others\n"
+      "   -D <float>          Percent of packets that are duplicated\n"
+      "   -b <float>          Bandwidth cap in Mbit/s\n"
+      "   -q <int>            Packets queued per direction before tail drop (default 1000)\n"
+      "   -u                  Impair only the client to server direction\n"
+      "   -S <int>            Random seed (default 1)\n"
+      "   -h                  prints this help\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  impairment_t imp;
+  impairment_t clean;
+  relay_stats_t stats[2];
+  uint64_t link_free_us[2] = { 0, 0 };
+  size_t queued[2] = { 0, 0 };
+  int bad_state[2] = { 0, 0 };
+  int one_way = 0;
+  int opt;
+  int listen_port = 0;
+  int server_port = 0;
+  char *ipstr = NULL;
+  int client_sock;
+  int server_sock;
+  uint8_t *buffer;
+  struct sockaddr_in sin;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in client_addr;
+  socklen_t addr_len;
+  int have_client = 0;
+  struct pollfd fds[2];
+  ssize_t received;
+  uint64_t now;
+  int timeout;
+  pending_t p;
+  int i;
+
+  memset (&imp, 0, sizeof(imp));
+  imp.queue_limit = 1000;
+  rng_state = 1;
+
+  while ((opt = getopt (argc, argv, "hl:a:p:d:j:L:g:r:D:b:q:uS:")) != -1) {
+    switch (opt)
+      {
+      case 'l':
+        listen_port = atoi (optarg);
+        break;
+      case 'a':
+        ipstr = strdup (optarg);
+        break;
+      case 'p':
+        server_port = atoi (optarg);
+        break;
+      case 'd':
+        imp.delay_ms = atof (optarg);
+        break;
+      case 'j':
+        imp.jitter_ms = atof (optarg);
+        break;
+      case 'L':
+        imp.loss = atof (optarg) / 100.0;
+        break;
+      case 'g':
+        if (sscanf (optarg, "%lf:%lf", &imp.burst_enter, &imp.burst_exit) != 2) {
+          usage ();
+          exit (EXIT_FAILURE);
+        }
+        imp.burst_enter /= 100.0;
+        imp.burst_exit /= 100.0;
+        break;
+      case 'r':
+        imp.reorder = atof (optarg) / 100.0;
+        break;
+      case 'D':
+        imp.duplicate = atof (optarg) / 100.0;
+        break;
+      case 'b':
+        imp.rate_bps = atof (optarg) * 1e6;
+        break;
+      case 'q':
+        imp.queue_limit = atoi (optarg);
+        break;
+      case 'u':
+        one_way = 1;
+        break;
+      case 'S':
+        rng_state = strtoull (optarg, NULL, 10);
+        if (rng_state == 0) {
+          rng_state = 1;
+        }
+        break;
+      default:
+        usage ();
+        exit (EXIT_FAILURE);
+      }
+  }
+  if (!listen_port || !server_port || !ipstr) {
+    usage ();
+    exit (EXIT_FAILURE);
+  }
+  memset (&clean, 0, sizeof(clean));
+  clean.queue_limit = imp.queue_limit;
+  memset (stats, 0, sizeof(stats));
+
+  buffer = (uint8_t *) malloc (MAX_DATAGRAM);
+  if (!buffer) {
+    perror ("Allocate relay buffer");
+    exit (EXIT_FAILURE);
+  }
+
+  client_sock = socket (AF_INET, SOCK_DGRAM, 0);
+  server_sock = socket (AF_INET, SOCK_DGRAM, 0);
+  if (client_sock == -1 || server_sock == -1) {
+    perror ("Opening UDP socket");
+    exit (EXIT_FAILURE);
+  }
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (bind (client_sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
+    perror ("Binding the relay port");
+    exit (EXIT_FAILURE);
+  }
+  memset (&server_addr, 0, sizeof(struct sockaddr_in));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons (server_port);
+  server_addr.sin_addr.s_addr = inet_addr (ipstr);
+
+  signal (SIGINT, sig_handler);
+  signal (SIGTERM, sig_handler);
+  printf ("Relaying port %d to %s:%d\n", listen_port, ipstr, server_port);
+
+  fds[0].fd = client_sock;
+  fds[0].events = POLLIN;
+  fds[1].fd = server_sock;
+  fds[1].events = POLLIN;
+  while (running) {
+    timeout = -1;
+    if (heap_len > 0) {
+      now = now_us ();
+      timeout = heap[0].departure_us > now ?
+          (int) ((heap[0].departure_us - now + 999) / 1000) : 0;
+    }
+    if (poll (fds, 2, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror ("Waiting for datagrams");
+      break;
+    }
+
+    for (i = 0; i < 2; i++) {
+      if (!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      addr_len = sizeof(struct sockaddr_in);
+      received = recvfrom (fds[i].fd, buffer, MAX_DATAGRAM, 0,
+                           (struct sockaddr *) &sin, &addr_len);
+      if (received == -1) {
+        continue;
+      }
+      if (i == TO_SERVER) {
+        /* The client is whoever talks to the relay port */
+        client_addr = sin;
+        have_client = 1;
+      }
+      impair ((i == TO_CLIENT && one_way) ? &clean : &imp, &bad_state[i],
+              &link_free_us[i], &queued[i], &stats[i], i, buffer, received);
+    }
+
+    now = now_us ();
+    while (heap_len > 0 && heap[0].departure_us <= now) {
+      p = heap_pop ();
+      queued[p.direction]--;
+      if (p.direction == TO_SERVER) {
+        sendto (server_sock, p.data, p.len, 0,
+                (struct sockaddr *) &server_addr, sizeof(struct sockaddr_in));
+        stats[p.direction].forwarded++;
+      }
+      else if (have_client) {
+        sendto (client_sock, p.data, p.len, 0,
+                (struct sockaddr *) &client_addr, sizeof(struct sockaddr_in));
+        stats[p.direction].forwarded++;
+      }
+      free (p.data);
+    }
+  }
+
+  print_stats ("client -> server", &stats[TO_SERVER]);
+  print_stats ("server -> client", &stats[TO_CLIENT]);
+  while (heap_len > 0) {
+    p = heap_pop ();
+    free (p.data);
+  }
+  free (heap);
+  free (buffer);
+  free (ipstr);
+  close (client_sock);
+  close (server_sock);
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Converts a trace file written by microtcp_trace_save() to CSV, one row
+ * per event with the time relative to the first event, in the spirit of
+ * the Linux tcp_probe output.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../lib/microtcp.h"
+
+static const char *
+event_name (uint32_t type)
+{
+  switch (type)
+    {
+    case TRACE_SEND:
+      return "send";
+    case TRACE_RETRANSMIT:
+      return "retransmit";
+    case TRACE_ACK:
+      return "ack";
+    case TRACE_DUP_ACK:
+      return "dup_ack";
+    case TRACE_TIMEOUT:
+      return "timeout";
+    case TRACE_LOSS:
+      return "loss";
+    case TRACE_UNDO:
+      return "undo";
+    case TRACE_RECV:
+      return "recv";
+    default:
+      return "unknown";
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  microtcp_trace_event_t ev;
+  uint32_t magic;
+  uint64_t start = 0;
+  int first = 1;
+  FILE *in;
+  FILE *out = stdout;
+
+  if (argc < 2 || argc > 3) {
+    printf ("Usage: trace_dump trace_file [csv_file]\n"
+            "Writes the events of a microTCP trace as CSV, to stdout if no csv_file is given.\n");
+    exit (EXIT_FAILURE);
+  }
+
+  in = fopen (argv[1], "rb");
+  if (!in) {
+    perror ("Open trace file");
+    exit (EXIT_FAILURE);
+  }
+  if (fread (&magic, sizeof(magic), 1, in) != 1
+      || magic != MICROTCP_TRACE_MAGIC) {
+    fprintf (stderr, "%s is not a microTCP trace\n", argv[1]);
+    fclose (in);
+    exit (EXIT_FAILURE);
+  }
+  if (argc == 3) {
+    out = fopen (argv[2], "w");
+    if (!out) {
+      perror ("Open CSV file");
+      fclose (in);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  fprintf (out, "time_s,event,seq,len,cwnd,ssthresh,peer_win,srtt_us,in_flight\n");
+  while (fread (&ev, sizeof(ev), 1, in) == 1) {
+    if (first) {
+      start = ev.time_us;
+      first = 0;
+    }
+    fprintf (out, "%.6f,%s,%u,%u,%u,%u,%u,%u,%u\n",
+             (ev.time_us - start) * 1e-6, event_name (ev.type), ev.seq,
+             ev.len, ev.cwnd, ev.ssthresh, ev.peer_win, ev.srtt_us,
+             ev.in_flight);
+  }
+
+  fclose (in);
+  if (out != stdout) {
+    fclose (out);
+  }
+  return 0;
+}
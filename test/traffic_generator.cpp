@@ -33,6 +33,7 @@ extern "C" {
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
 }
+#include "traffic_message.h"
 
 #define BUF_LEN 2048
 
@@ -54,7 +55,14 @@ main (int argc, char **argv)
   int                   opt;
   int                   ret;
   int                   port;
-  int                   mean_inter;
+  int                   mean_inter = 10;
+  uint32_t              lifetime_ms = 0;
+  uint64_t              abandoned = 0;
+  ssize_t               sent;
+  uint64_t              seq = 0;
+  uint64_t              next_ns;
+  uint64_t              now_ns;
+  traffic_message_t     msg;
   microtcp_sock_t       sock;
   struct sockaddr_in    sin;
   struct sockaddr       client_addr;
@@ -67,8 +75,13 @@ main (int argc, char **argv)
   std::random_device rd;
   std::mt19937 gen(rd());
 
+  /* MICROTCP_LOG_LEVEL overrides the default */
+  if (!getenv ("MICROTCP_LOG_LEVEL")) {
+    log_set_level (LOG_LEVEL_INFO);
+  }
+
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hp:i:")) != -1) {
+  while ((opt = getopt (argc, argv, "hp:i:l:")) != -1) {
     switch (opt)
       {
       case 'p':
@@ -82,12 +95,20 @@ main (int argc, char **argv)
          */
         mean_inter = atoi (optarg);
         break;
+      case 'l':
+        /*
+         * Send every message with this lifetime in milliseconds, the
+         * ones still unacknowledged by then are abandoned
+         */
+        lifetime_ms = atoi (optarg);
+        break;
       default:
         printf (
             "Usage: bandwidth_test -p port -i packet inter-arrival ms"
             "Options:\n"
             "   -p <int>            the port to wait for a peer"
             "   -i <int>            the mean inter-arrival time in milliseconds of the poisson distribution"
+            "   -l <int>            message lifetime in milliseconds, for traffic_generator_client -m"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -95,6 +116,9 @@ main (int argc, char **argv)
   std::poisson_distribution<int> dpoisson(mean_inter);
   LOG_INFO("Creating traffic generator on port %d", port);
   LOG_INFO("Poisson distribution inter-arrivals with mean %u ms", mean_inter);
+  if (lifetime_ms > 0) {
+    LOG_INFO("Messages expire after %u ms", lifetime_ms);
+  }
 
   /*
    * Register a signal handler so we can terminate the generator with
@@ -103,9 +127,11 @@ main (int argc, char **argv)
   signal(SIGINT, sig_handler);
 
   /* Create a microtcp socket */
-  sock = microtcp_socket (AF_INET, 0, 0);
- /* TODO: some error checking here ??? */
-
+  sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock.state == INVALID) {
+    LOG_ERROR("Failed to create the microtcp socket");
+    return -EXIT_FAILURE;
+  }
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
   sin.sin_port = htons (port);
@@ -138,9 +164,43 @@ main (int argc, char **argv)
   std::this_thread::sleep_for (std::chrono::seconds(1));
   LOG_INFO("Start generating traffic...");
 
+  /*
+   * Messages follow a fixed Poisson schedule. A message that could not be
+   * sent on time keeps its scheduled time, so the receiver sees the delay
+   * it suffered behind the previous ones.
+   */
+  memset (buffer, 0, BUF_LEN);
+  next_ns = traffic_now_ns ();
   while(stop_traffic == false) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
-    microtcp_send(&sock, buffer, BUF_LEN, 0);
+    next_ns += (uint64_t) dpoisson(gen) * 1000000;
+    now_ns = traffic_now_ns ();
+    if (next_ns > now_ns) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next_ns - now_ns));
+    }
+    msg.magic = TRAFFIC_MAGIC;
+    msg.len = BUF_LEN;
+    msg.seq = seq++;
+    msg.scheduled_ns = next_ns;
+    msg.sent_ns = traffic_now_ns ();
+    memcpy (buffer, &msg, sizeof(msg));
+    if (lifetime_ms > 0) {
+      sent = microtcp_send_msg (&sock, 0, buffer, BUF_LEN, lifetime_ms);
+      if (sent == 0) {
+        abandoned++;
+        continue;
+      }
+    }
+    else {
+      sent = microtcp_send (&sock, buffer, BUF_LEN, 0);
+    }
+    if (sent != BUF_LEN) {
+      LOG_ERROR("Failed to send message %llu", (unsigned long long) msg.seq);
+      break;
+    }
+  }
+  if (abandoned > 0) {
+    LOG_INFO("%llu messages expired before they were acknowledged",
+             (unsigned long long) abandoned);
   }
 
   LOG_INFO("Going to terminate microtcp connection...");
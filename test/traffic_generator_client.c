@@ -18,9 +18,19 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Receiving end of traffic_generator. Every message carries the time the
+ * generator meant to send it and the time it actually did; the client
+ * records the one-way latency (sent to received) and the delivery latency
+ * (scheduled to received, which includes the time spent waiting behind
+ * earlier messages) in histograms and prints their percentiles on Ctrl+C.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -28,37 +38,218 @@
 
 #include "../lib/microtcp.h"
 #include "../utils/log.h"
+#include "../utils/histogram.h"
+#include "traffic_message.h"
+
+#define BUF_LEN 65536
 
-static char running = 1;
+static volatile sig_atomic_t running = 1;
 
 static void
 sig_handler(int signal)
 {
   if(signal == SIGINT) {
-    LOG_INFO("Stopping traffic generator client...");
     running = 0;
   }
 }
 
+static void
+print_histogram(const char *name, const histogram_t *h)
+{
+  printf("%-10s samples %llu, mean %llu us, p50 %llu us, p99 %llu us, "
+         "p99.9 %llu us, max %llu us\n", name,
+         (unsigned long long) h->total,
+         (unsigned long long) histogram_mean(h),
+         (unsigned long long) histogram_percentile(h, 50.0),
+         (unsigned long long) histogram_percentile(h, 99.0),
+         (unsigned long long) histogram_percentile(h, 99.9),
+         (unsigned long long) h->max);
+}
+
+/* Writes the latency distributions as CSV for plotting */
+static int
+save_percentiles(const char *file, const histogram_t *one_way,
+                 const histogram_t *delivery)
+{
+  static const double percentiles[] =
+    { 0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 99, 99.5, 99.9, 99.99, 100 };
+  FILE *fp;
+  size_t i;
+
+  fp = fopen(file, "w");
+  if(!fp) {
+    perror("Open percentile file");
+    return -1;
+  }
+  fprintf(fp, "percentile,one_way_us,delivery_us\n");
+  for(i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+    fprintf(fp, "%g,%llu,%llu\n", percentiles[i],
+            (unsigned long long) histogram_percentile(one_way, percentiles[i]),
+            (unsigned long long) histogram_percentile(delivery, percentiles[i]));
+  }
+  return fclose(fp);
+}
+
+static uint64_t
+latency_us(uint64_t from_ns, uint64_t to_ns)
+{
+  /* Clocks of different hosts may be slightly off, never go negative */
+  return to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+}
+
 int
 main(int argc, char **argv) {
-  uint16_t port=0;
+  uint16_t port = 0;
+  char *ipstr = NULL;
+  const char *outfile = NULL;
+  int opt;
+  int msg_mode = 0;
+  uint32_t stream;
+  microtcp_sock_t sock;
+  struct sockaddr_in sin;
+  struct sigaction sa;
+  histogram_t *one_way;
+  histogram_t *delivery;
+  traffic_message_t msg;
+  uint8_t *buffer;
+  size_t fill = 0;
+  size_t offset;
+  ssize_t received;
+  uint64_t now_ns;
+  uint64_t expected_seq = 0;
+  uint64_t gaps = 0;
+
+  /* MICROTCP_LOG_LEVEL overrides the default */
+  if(!getenv("MICROTCP_LOG_LEVEL")) {
+    log_set_level(LOG_LEVEL_INFO);
+  }
+
+  while((opt = getopt(argc, argv, "ha:p:o:m")) != -1) {
+    switch(opt)
+      {
+      case 'a':
+        ipstr = strdup(optarg);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'o':
+        outfile = optarg;
+        break;
+      case 'm':
+        msg_mode = 1;
+        break;
+      default:
+        printf(
+            "Usage: traffic_generator_client -a address -p port [-o file] [-m]\n"
+            "Options:\n"
+            "   -a <string>         the address of the traffic generator\n"
+            "   -p <int>            the port of the traffic generator\n"
+            "   -o <string>         also write the latency percentiles to this CSV file\n"
+            "   -m                  receive whole messages, for traffic_generator -l\n"
+            "   -h                  prints this help\n");
+        exit(EXIT_FAILURE);
+      }
+  }
+  if(!ipstr || !port) {
+    LOG_ERROR("The address and the port of the generator are required");
+    exit(EXIT_FAILURE);
+  }
 
   /*
    * Register a signal handler so we can terminate the client with
-   * Ctrl+C
+   * Ctrl+C. No SA_RESTART, so a blocked microtcp_recv() returns.
    */
-  signal(SIGINT, sig_handler);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+
+  one_way = (histogram_t *) malloc(sizeof(histogram_t));
+  delivery = (histogram_t *) malloc(sizeof(histogram_t));
+  buffer = (uint8_t *) malloc(BUF_LEN);
+  if(!one_way || !delivery || !buffer) {
+    perror("Allocate client buffers");
+    exit(EXIT_FAILURE);
+  }
+  histogram_reset(one_way);
+  histogram_reset(delivery);
 
-  LOG_INFO("Start receiving traffic from port %u", port);
-  /*TODO: Connect using microtcp_connect() */
+  sock = microtcp_socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock.state == INVALID) {
+    LOG_ERROR("Failed to create the microtcp socket");
+    exit(EXIT_FAILURE);
+  }
+  memset(&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = inet_addr(ipstr);
+  if(microtcp_connect(&sock, (struct sockaddr *) &sin,
+                      sizeof(struct sockaddr_in)) != 0) {
+    LOG_ERROR("Failed to connect to %s:%u", ipstr, port);
+    exit(EXIT_FAILURE);
+  }
+
+  LOG_INFO("Start receiving traffic from %s:%u", ipstr, port);
   while(running) {
-    /* TODO: Measure time */
-    /* TODO: Receive using microtcp_recv()*/
-    /* TODO: Measure time */
-    /* TODO: Do other stuff... */
+    if(msg_mode) {
+      /* One message per call, the expired ones show up as gaps */
+      received = microtcp_recv_msg(&sock, &stream, buffer, BUF_LEN, 0);
+    }
+    else {
+      received = microtcp_recv(&sock, buffer + fill, BUF_LEN - fill, 0);
+    }
+    if(received <= 0) {
+      if(running) {
+        LOG_INFO("The generator closed the connection");
+      }
+      break;
+    }
+    now_ns = traffic_now_ns();
+    fill += received;
+
+    /* Record every message completed by this read */
+    offset = 0;
+    while(fill - offset >= sizeof(traffic_message_t)) {
+      memcpy(&msg, buffer + offset, sizeof(traffic_message_t));
+      if(msg.magic != TRAFFIC_MAGIC || msg.len < sizeof(traffic_message_t)
+         || msg.len > BUF_LEN) {
+        LOG_ERROR("Lost message framing at message %llu",
+                  (unsigned long long) expected_seq);
+        running = 0;
+        break;
+      }
+      if(fill - offset < msg.len) {
+        break;
+      }
+      if(msg.seq != expected_seq) {
+        gaps++;
+      }
+      expected_seq = msg.seq + 1;
+      histogram_record(one_way, latency_us(msg.sent_ns, now_ns));
+      histogram_record(delivery, latency_us(msg.scheduled_ns, now_ns));
+      offset += msg.len;
+    }
+    memmove(buffer, buffer + offset, fill - offset);
+    fill -= offset;
   }
 
-  /* Ctrl+C pressed! Store properly time measurements for plotting */
-}
+  /* Ctrl+C pressed! */
+  printf("Received %llu messages", (unsigned long long) one_way->total);
+  if(gaps) {
+    printf(", %llu out of sequence", (unsigned long long) gaps);
+  }
+  printf("\n");
+  print_histogram("one-way", one_way);
+  print_histogram("delivery", delivery);
+  if(outfile && save_percentiles(outfile, one_way, delivery) == 0) {
+    printf("Percentiles saved to %s\n", outfile);
+  }
 
+  close(sock.sd);
+  free(buffer);
+  free(one_way);
+  free(delivery);
+  free(ipstr);
+  return 0;
+}
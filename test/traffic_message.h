@@ -0,0 +1,51 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_TRAFFIC_MESSAGE_H_
+#define TEST_TRAFFIC_MESSAGE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRAFFIC_MAGIC 0x74726166
+
+/**
+ * Header at the start of every message of traffic_generator. The times
+ * are CLOCK_REALTIME nanoseconds, so one-way latency across hosts is only
+ * as good as their clock synchronization.
+ */
+typedef struct
+{
+  uint32_t magic;               /**< TRAFFIC_MAGIC */
+  uint32_t len;                 /**< Message length, header included */
+  uint64_t seq;                 /**< Message number, starting from 0 */
+  uint64_t scheduled_ns;        /**< When the Poisson process wanted it sent */
+  uint64_t sent_ns;             /**< When it was handed to microtcp_send() */
+} traffic_message_t;
+
+static inline uint64_t
+traffic_now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* TEST_TRAFFIC_MESSAGE_H_ */
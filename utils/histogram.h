@@ -0,0 +1,131 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_HISTOGRAM_H_
+#define UTILS_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram. Every power of two
+ * is split in 2^HISTOGRAM_SUB_BITS linear sub-buckets, so any recorded
+ * value is reported within 1/2^HISTOGRAM_SUB_BITS of its real value.
+ * Values up to 2^HISTOGRAM_MAX_BITS are tracked, larger ones saturate.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+typedef struct histogram
+{
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;               /**< Number of recorded values */
+  uint64_t sum;                 /**< Sum of the recorded values */
+  uint64_t min;
+  uint64_t max;
+} histogram_t;
+
+static inline void
+histogram_reset (histogram_t *h)
+{
+  memset (h, 0, sizeof(histogram_t));
+}
+
+static inline unsigned int
+histogram_index (uint64_t value)
+{
+  unsigned int magnitude;
+  if (value >= (1ULL << HISTOGRAM_MAX_BITS)) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  if (value < (1U << HISTOGRAM_SUB_BITS)) {
+    return value;
+  }
+  magnitude = 63 - __builtin_clzll (value);
+  return ((magnitude - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+      + (value >> (magnitude - HISTOGRAM_SUB_BITS))
+      - (1U << HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * @return the highest value that maps to the same bucket as index
+ */
+static inline uint64_t
+histogram_bucket_value (unsigned int index)
+{
+  unsigned int shift;
+  uint64_t sub;
+  if (index < (1U << HISTOGRAM_SUB_BITS)) {
+    return index;
+  }
+  shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+  sub = (index & ((1U << HISTOGRAM_SUB_BITS) - 1)) + (1U << HISTOGRAM_SUB_BITS);
+  return ((sub + 1) << shift) - 1;
+}
+
+static inline void
+histogram_record (histogram_t *h, uint64_t value)
+{
+  h->counts[histogram_index (value)]++;
+  if (h->total == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+  h->total++;
+  h->sum += value;
+}
+
+/**
+ * @param percentile in the range [0, 100]
+ * @return the value below which the given percentage of the samples fall
+ */
+static inline uint64_t
+histogram_percentile (const histogram_t *h, double percentile)
+{
+  uint64_t target;
+  uint64_t seen = 0;
+  unsigned int i;
+  if (h->total == 0) {
+    return 0;
+  }
+  target = (uint64_t) (percentile / 100.0 * h->total + 0.5);
+  if (target < 1) {
+    target = 1;
+  }
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      return (histogram_bucket_value (i) < h->max) ?
+          histogram_bucket_value (i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+static inline uint64_t
+histogram_mean (const histogram_t *h)
+{
+  return (h->total == 0) ? 0 : h->sum / h->total;
+}
+
+#endif /* UTILS_HISTOGRAM_H_ */
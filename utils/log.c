@@ -0,0 +1,228 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous logger. Callers format their message into a slot of a
+ * bounded lock-free multi-producer queue and return; a background thread
+ * adds the level and location prefix and writes the messages to stderr
+ * in batches. When the queue is full messages are dropped and counted
+ * rather than blocking the caller. With the queue empty the thread sleeps
+ * on a condition variable until the next message.
+ */
+
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct
+{
+  size_t seq;                   /* Queue position the slot is ready for */
+  int level;
+  const char *file;
+  int line;
+  char msg[LOG_MSG_LEN];
+} log_slot_t;
+
+volatile int log_level = LOG_LEVEL_WARN;
+
+static log_slot_t queue[LOG_QUEUE_LEN];
+static size_t enqueue_pos;
+static size_t dequeue_pos;
+static uint64_t dropped;
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static int running;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int waiting;             /* The logging thread sleeps on wake */
+
+static const char *level_prefix[] =
+  { "", "[ERROR] ", "[WARNING] ", "[INFO]: ", "[DEBUG]: " };
+
+static void
+log_sleep_us (long us)
+{
+  struct timespec ts;
+  ts.tv_sec = 0;
+  ts.tv_nsec = us * 1000;
+  nanosleep (&ts, NULL);
+}
+
+/* Whether the slot at the head of the queue holds a message */
+static int
+log_ready (void)
+{
+  size_t pos = __atomic_load_n (&dequeue_pos, __ATOMIC_RELAXED);
+  return __atomic_load_n (&queue[pos % LOG_QUEUE_LEN].seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+static void
+log_wait (void)
+{
+  pthread_mutex_lock (&wake_lock);
+  __atomic_store_n (&waiting, 1, __ATOMIC_SEQ_CST);
+  /* A message published before waiting was set is seen here */
+  if (log_ready ()) {
+    __atomic_store_n (&waiting, 0, __ATOMIC_RELAXED);
+  }
+  while (__atomic_load_n (&waiting, __ATOMIC_RELAXED)) {
+    pthread_cond_wait (&wake, &wake_lock);
+  }
+  pthread_mutex_unlock (&wake_lock);
+}
+
+static void *
+log_thread (void *arg)
+{
+  log_slot_t *slot;
+  uint64_t lost;
+  size_t pos;
+  (void) arg;
+
+  for (;;) {
+    pos = __atomic_load_n (&dequeue_pos, __ATOMIC_RELAXED);
+    slot = &queue[pos % LOG_QUEUE_LEN];
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      /* Queue empty, push out the batch and wait for more */
+      lost = __atomic_exchange_n (&dropped, 0, __ATOMIC_RELAXED);
+      if (lost) {
+        fprintf (stderr, "[WARNING] log: %llu messages dropped\n",
+                 (unsigned long long) lost);
+      }
+      fflush (stderr);
+      log_wait ();
+      continue;
+    }
+    fprintf (stderr, "%s%s:%d: %s\n", level_prefix[slot->level], slot->file,
+             slot->line, slot->msg);
+    __atomic_store_n (&slot->seq, pos + LOG_QUEUE_LEN, __ATOMIC_RELEASE);
+    __atomic_store_n (&dequeue_pos, pos + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void
+log_start (void)
+{
+  pthread_t thread;
+  size_t i;
+
+  for (i = 0; i < LOG_QUEUE_LEN; i++) {
+    queue[i].seq = i;
+  }
+  if (pthread_create (&thread, NULL, log_thread, NULL) != 0) {
+    perror ("Starting the logging thread");
+    return;
+  }
+  pthread_detach (thread);
+  running = 1;
+  atexit (log_flush);
+}
+
+__attribute__((constructor)) static void
+log_level_from_env (void)
+{
+  const char *env = getenv ("MICROTCP_LOG_LEVEL");
+  if (env) {
+    log_set_level (atoi (env));
+  }
+}
+
+void
+log_set_level (int level)
+{
+  if (level < LOG_LEVEL_OFF) {
+    level = LOG_LEVEL_OFF;
+  }
+  if (level > LOG_LEVEL_DEBUG) {
+    level = LOG_LEVEL_DEBUG;
+  }
+  log_level = level;
+}
+
+void
+log_write (int level, const char *file, int line, const char *fmt, ...)
+{
+  log_slot_t *slot;
+  size_t pos;
+  size_t seq;
+  va_list ap;
+
+  if (level <= LOG_LEVEL_OFF || level > LOG_LEVEL_DEBUG) {
+    return;
+  }
+  pthread_once (&started, log_start);
+  if (!running) {
+    return;
+  }
+
+  /* Claim a free slot */
+  pos = __atomic_load_n (&enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &queue[pos % LOG_QUEUE_LEN];
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n (&enqueue_pos, &pos, pos + 1, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if ((intptr_t) (seq - pos) < 0) {
+      /* Full, the logging thread has not caught up */
+      __atomic_fetch_add (&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else {
+      pos = __atomic_load_n (&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->level = level;
+  slot->file = file;
+  slot->line = line;
+  va_start (ap, fmt);
+  vsnprintf (slot->msg, LOG_MSG_LEN, fmt, ap);
+  va_end (ap);
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock (&wake_lock);
+    __atomic_store_n (&waiting, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal (&wake);
+    pthread_mutex_unlock (&wake_lock);
+  }
+}
+
+void
+log_flush (void)
+{
+  size_t target;
+
+  if (!running) {
+    return;
+  }
+  target = __atomic_load_n (&enqueue_pos, __ATOMIC_ACQUIRE);
+  while ((intptr_t) (__atomic_load_n (&dequeue_pos, __ATOMIC_ACQUIRE) - target) < 0) {
+    log_sleep_us (100);
+  }
+  fflush (stderr);
+}
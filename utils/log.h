@@ -26,28 +26,67 @@
 #include <string.h>
 #include <sys/syscall.h>
 
-/* Set to 0 to disable debug messages at compile time ;) */
-#define ENABLE_DEBUG_MSG 1
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-#if ENABLE_DEBUG_MSG
-#define LOG_INFO(M, ...)                                                        \
-                fprintf(stderr, "[INFO]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/*
+ * Log levels, a message is kept if its level is not above the current one.
+ */
+#define LOG_LEVEL_OFF   0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
 
-#else
-#define LOG_INFO(M, ...)
-#endif
+/* Messages longer than this are truncated */
+#define LOG_MSG_LEN 256
+/* Messages that can wait for the logging thread, more are dropped */
+#define LOG_QUEUE_LEN 4096
+
+/* Current level, read on every LOG_* call. Use log_set_level() to change it. */
+extern volatile int log_level;
+
+/**
+ * Sets the runtime log level. The initial level is LOG_LEVEL_WARN, or the
+ * value of the MICROTCP_LOG_LEVEL environment variable (0-4) if set.
+ */
+void
+log_set_level (int level);
+
+/**
+ * Queues a message for the logging thread. Only the caller's formatting
+ * happens here; the write to stderr is done in the background.
+ */
+void
+log_write (int level, const char *file, int line, const char *fmt, ...)
+    __attribute__((format (printf, 4, 5)));
+
+/**
+ * Blocks until every queued message has been written. Called at exit.
+ */
+void
+log_flush (void);
+
+/*
+ * Disabled levels cost a load and a compare, the arguments are not evaluated.
+ */
+#define LOG_AT(L, M, ...)                                                       \
+        do {                                                                    \
+          if ((L) <= log_level)                                                 \
+            log_write ((L), __FILE__, __LINE__, M, ##__VA_ARGS__);              \
+        } while (0)
+
+#define LOG_INFO(M, ...) LOG_AT(LOG_LEVEL_INFO, M, ##__VA_ARGS__)
+
+#define LOG_ERROR(M, ...) LOG_AT(LOG_LEVEL_ERROR, M, ##__VA_ARGS__)
 
-#define LOG_ERROR(M, ...)                                                       \
-        fprintf(stderr, "[ERROR] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define LOG_WARN(M, ...) LOG_AT(LOG_LEVEL_WARN, M, ##__VA_ARGS__)
 
-#define LOG_WARN(M, ...)                                                                \
-        fprintf(stderr, "[WARNING] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define LOG_DEBUG(M, ...) LOG_AT(LOG_LEVEL_DEBUG, M, ##__VA_ARGS__)
 
-#if ENABLE_DEBUG_MSG
-#define LOG_DEBUG(M, ...)                                                       \
-        fprintf(stderr, "[DEBUG]: %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#else
-#define LOG_DEBUG(M, ...)
+#ifdef __cplusplus
+}
 #endif
 
 #endif /* UTILS_LOG_H_ */
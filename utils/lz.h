@@ -0,0 +1,247 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef UTILS_LZ_H_
+#define UTILS_LZ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * LZ77 block compression in the spirit of LZ4, fast rather than tight.
+ * Matches are found through a hash table of 4 byte sequences and taken
+ * greedily, and the search speeds up over data that does not match so
+ * incompressible input costs little.
+ *
+ * A block is a series of sequences, each a token with the literal length
+ * in its high nibble and the match length minus LZ_MIN_MATCH in its low
+ * one, lengths of 15 or more continued in bytes up to 255, the literals,
+ * and a 16 bit little endian match offset. The last sequence has literals
+ * only. Blocks hold at most LZ_MAX_INPUT bytes.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_INPUT 65535
+#define LZ_SKIP_TRIGGER 6       /* Every 2^LZ_SKIP_TRIGGER misses the search step grows */
+
+static inline uint32_t
+lz_read32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof(uint32_t));
+  return v;
+}
+
+static inline uint32_t
+lz_hash (uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Bytes a sequence takes, the match part only if mlen is not 0 */
+static inline size_t
+lz_sequence_len (size_t lit, size_t mlen)
+{
+  size_t n = 1 + lit;
+  if (lit >= 15) {
+    n += (lit - 15) / 255 + 1;
+  }
+  if (mlen > 0) {
+    n += 2;
+    if (mlen - LZ_MIN_MATCH >= 15) {
+      n += (mlen - LZ_MIN_MATCH - 15) / 255 + 1;
+    }
+  }
+  return n;
+}
+
+static inline uint8_t *
+lz_put_length (uint8_t *op, size_t len)
+{
+  len -= 15;
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t) len;
+  return op;
+}
+
+static inline uint8_t *
+lz_put_sequence (uint8_t *op, const uint8_t *lit, size_t lit_len,
+                 size_t offset, size_t mlen)
+{
+  size_t code = (mlen > 0) ? mlen - LZ_MIN_MATCH : 0;
+  *op++ = (uint8_t) (((lit_len < 15) ? lit_len : 15) << 4
+      | ((code < 15) ? code : 15));
+  if (lit_len >= 15) {
+    op = lz_put_length (op, lit_len);
+  }
+  memcpy (op, lit, lit_len);
+  op += lit_len;
+  if (mlen > 0) {
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    if (code >= 15) {
+      op = lz_put_length (op, code);
+    }
+  }
+  return op;
+}
+
+/**
+ * Compresses as much of src as fits in dst. The block ends after the
+ * last whole sequence that fits, so compressing only the bytes it took
+ * gives the same block again.
+ *
+ * @param len the bytes available in src, at most LZ_MAX_INPUT, set to
+ * the bytes the block holds
+ * @return the length of the block, 0 if not even one sequence fits
+ */
+static inline size_t
+lz_compress (const uint8_t *src, size_t *len, uint8_t *dst, size_t dst_len)
+{
+  uint16_t table[1 << LZ_HASH_BITS];
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *iend = src + *len;
+  const uint8_t *ref;
+  const uint8_t *m;
+  uint8_t *op = dst;
+  size_t misses = 0;
+  size_t n;
+  uint32_t h;
+
+  memset (table, 0, sizeof(table));
+  while (iend - ip >= LZ_MIN_MATCH) {
+    h = lz_hash (lz_read32 (ip));
+    ref = src + table[h];
+    table[h] = (uint16_t) (ip - src);
+    if (ref >= ip || lz_read32 (ref) != lz_read32 (ip)) {
+      ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+      continue;
+    }
+    for (m = ip + LZ_MIN_MATCH; m < iend && *m == ref[m - ip]; m++);
+    n = lz_sequence_len (ip - anchor, m - ip);
+    /* Keep a byte for the closing token */
+    if (n + 1 > dst_len - (size_t) (op - dst)) {
+      break;
+    }
+    op = lz_put_sequence (op, anchor, ip - anchor, ip - ref, m - ip);
+    ip = m;
+    anchor = ip;
+    misses = 0;
+  }
+  if (ip >= iend
+      && lz_sequence_len (iend - anchor, 0) <= dst_len - (size_t) (op - dst)) {
+    /* All the input made it, the rest goes as literals */
+    op = lz_put_sequence (op, anchor, iend - anchor, 0, 0);
+    anchor = iend;
+  }
+  else if (anchor == src || op == dst + dst_len) {
+    return 0;
+  }
+  else {
+    op = lz_put_sequence (op, anchor, 0, 0, 0);
+  }
+  *len = anchor - src;
+  return op - dst;
+}
+
+static inline int
+lz_get_length (const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+  uint8_t b;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  }
+  while (b == 255);
+  return 0;
+}
+
+/**
+ * Decompresses a block, checking every length and offset against the
+ * buffers so that a corrupt block is an error rather than an overrun.
+ *
+ * @return the decompressed length, or -1 if the block is corrupt or
+ * does not fit in dst_len bytes
+ */
+static inline ssize_t
+lz_decompress (const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  const uint8_t *from;
+  uint8_t token;
+  size_t lit;
+  size_t mlen;
+  size_t offset;
+  size_t n;
+
+  while (ip < iend) {
+    token = *ip++;
+    lit = token >> 4;
+    if (lit == 15 && lz_get_length (&ip, iend, &lit) == -1) {
+      return -1;
+    }
+    if (lit > (size_t) (iend - ip) || lit > dst_len - (size_t) (op - dst)) {
+      return -1;
+    }
+    memcpy (op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) {
+      break;
+    }
+    if (iend - ip < 2) {
+      return -1;
+    }
+    offset = ip[0] | (size_t) ip[1] << 8;
+    ip += 2;
+    mlen = token & 15;
+    if (mlen == 15 && lz_get_length (&ip, iend, &mlen) == -1) {
+      return -1;
+    }
+    mlen += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - dst)
+        || mlen > dst_len - (size_t) (op - dst)) {
+      return -1;
+    }
+    /* A match may overlap what it produces, it is copied offset bytes at a time */
+    from = op - offset;
+    while (mlen > 0) {
+      n = (mlen < offset) ? mlen : offset;
+      memcpy (op, from, n);
+      op += n;
+      mlen -= n;
+    }
+  }
+  return op - dst;
+}
+
+#endif /* UTILS_LZ_H_ */
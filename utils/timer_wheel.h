@@ -0,0 +1,261 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_TIMER_WHEEL_H_
+#define UTILS_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Hierarchical timer wheel. Level 0 has a slot per tick and every level
+ * above is TIMER_WHEEL_SLOTS times coarser; the timers of a slot move one
+ * level down when the wheel reaches it. Adding, re-arming and cancelling
+ * a timer are O(1), and expiring costs O(1) per timer plus a bitmap scan
+ * every TIMER_WHEEL_SLOTS ticks, whatever the number of pending timers.
+ * Timers further away than the wheel spans are parked in the top level
+ * and looked at again when their slot comes around.
+ *
+ * The wheel does no locking and reads no clock, the owner passes the
+ * current monotonic time to timer_wheel_advance().
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 5
+
+typedef struct timer_entry
+{
+  struct timer_entry *next;
+  struct timer_entry **pprev;   /**< The link pointing to this timer, NULL when not pending */
+  uint64_t expires;             /**< Expiry tick */
+  unsigned int slot;            /**< Level * TIMER_WHEEL_SLOTS + slot while pending */
+  void (*fn) (struct timer_entry *t);
+  void *arg;                    /**< For the owner, untouched by the wheel */
+} timer_entry_t;
+
+typedef struct timer_wheel
+{
+  uint64_t tick_us;             /**< Length of a tick in microseconds */
+  uint64_t now;                 /**< Next tick to expire */
+  uint64_t occupied[TIMER_WHEEL_LEVELS]; /**< Bitmap of the non empty slots of each level */
+  timer_entry_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  size_t count;                 /**< Pending timers */
+} timer_wheel_t;
+
+static inline void
+timer_wheel_init (timer_wheel_t *w, uint64_t tick_us, uint64_t now_us)
+{
+  memset (w, 0, sizeof(timer_wheel_t));
+  w->tick_us = tick_us;
+  w->now = now_us / tick_us;
+}
+
+static inline void
+timer_init (timer_entry_t *t, void (*fn) (timer_entry_t *), void *arg)
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->slot = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+static inline int
+timer_pending (const timer_entry_t *t)
+{
+  return t->pprev != NULL;
+}
+
+static inline void
+timer_wheel_link (timer_wheel_t *w, timer_entry_t *t)
+{
+  uint64_t expires = (t->expires > w->now) ? t->expires : w->now;
+  uint64_t delta = expires - w->now;
+  unsigned int level = 0;
+  unsigned int slot;
+
+  if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+    expires = w->now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    delta = expires - w->now;
+  }
+  while (delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+  slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  t->slot = level * TIMER_WHEEL_SLOTS + slot;
+  t->next = w->slots[level][slot];
+  if (t->next) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = &w->slots[level][slot];
+  w->slots[level][slot] = t;
+  w->occupied[level] |= 1ULL << slot;
+}
+
+static inline void
+timer_wheel_unlink (timer_wheel_t *w, timer_entry_t *t)
+{
+  unsigned int level = t->slot / TIMER_WHEEL_SLOTS;
+  unsigned int slot = t->slot % TIMER_WHEEL_SLOTS;
+  *t->pprev = t->next;
+  if (t->next) {
+    t->next->pprev = t->pprev;
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+  if (w->slots[level][slot] == NULL) {
+    w->occupied[level] &= ~(1ULL << slot);
+  }
+}
+
+/**
+ * Cancels a timer, nothing happens if it is not pending
+ */
+static inline void
+timer_wheel_del (timer_wheel_t *w, timer_entry_t *t)
+{
+  if (timer_pending (t)) {
+    timer_wheel_unlink (w, t);
+    w->count--;
+  }
+}
+
+/**
+ * Arms a timer to fire at expires_us, moving it if it is already pending.
+ * A time in the past fires at the next timer_wheel_advance().
+ */
+static inline void
+timer_wheel_add (timer_wheel_t *w, timer_entry_t *t, uint64_t expires_us)
+{
+  timer_wheel_del (w, t);
+  t->expires = (expires_us + w->tick_us - 1) / w->tick_us;
+  timer_wheel_link (w, t);
+  w->count++;
+}
+
+/* Moves the timers of the current slot of a level to the levels below */
+static inline void
+timer_wheel_cascade (timer_wheel_t *w, unsigned int level)
+{
+  unsigned int slot = (w->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  timer_entry_t *t;
+  while ((t = w->slots[level][slot]) != NULL) {
+    timer_wheel_unlink (w, t);
+    timer_wheel_link (w, t);
+  }
+}
+
+/**
+ * Runs the callbacks of the timers expired by now_us. A callback may add
+ * or cancel any timer, including its own.
+ *
+ * @return the number of callbacks run
+ */
+static inline size_t
+timer_wheel_advance (timer_wheel_t *w, uint64_t now_us)
+{
+  uint64_t target = now_us / w->tick_us;
+  uint64_t ahead;
+  unsigned int idx;
+  unsigned int level;
+  timer_entry_t *t;
+  size_t fired = 0;
+
+  while (w->now <= target) {
+    if (w->count == 0) {
+      w->now = target + 1;
+      break;
+    }
+    idx = w->now & TIMER_WHEEL_MASK;
+    if (idx == 0) {
+      for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        if ((w->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) == 0) {
+          timer_wheel_cascade (w, level);
+        }
+      }
+    }
+    while ((t = w->slots[0][idx]) != NULL) {
+      timer_wheel_unlink (w, t);
+      w->count--;
+      fired++;
+      t->fn (t);
+    }
+    /* Skip to the next busy slot of this round, or to the next round */
+    ahead = w->occupied[0] >> idx;
+    if (ahead & ~1ULL) {
+      w->now += __builtin_ctzll (ahead & ~1ULL);
+    }
+    else {
+      w->now = (w->now | TIMER_WHEEL_MASK) + 1;
+    }
+    if (w->now > target + 1) {
+      w->now = target + 1;
+    }
+  }
+  return fired;
+}
+
+/**
+ * @return a time in microseconds no later than the earliest pending
+ * timer, exact if it fires within the next TIMER_WHEEL_SLOTS ticks, or
+ * UINT64_MAX if no timer is pending
+ */
+static inline uint64_t
+timer_wheel_next (const timer_wheel_t *w)
+{
+  uint64_t best = UINT64_MAX;
+  uint64_t occ;
+  uint64_t tick;
+  unsigned int level;
+  unsigned int pos;
+  unsigned int d;
+
+  if (w->count == 0) {
+    return UINT64_MAX;
+  }
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    occ = w->occupied[level];
+    if (occ == 0) {
+      continue;
+    }
+    pos = (w->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    if (level == 0) {
+      /* Slots before the current one belong to the next round */
+      occ = (occ >> pos) | (occ << ((TIMER_WHEEL_SLOTS - pos) & TIMER_WHEEL_MASK));
+      tick = w->now + __builtin_ctzll (occ);
+    }
+    else {
+      /* The current slot of a level was emptied when the wheel reached it */
+      pos = (pos + 1) & TIMER_WHEEL_MASK;
+      occ = (occ >> pos) | (occ << ((TIMER_WHEEL_SLOTS - pos) & TIMER_WHEEL_MASK));
+      d = __builtin_ctzll (occ) + 1;
+      tick = ((w->now >> (TIMER_WHEEL_BITS * level)) + d) << (TIMER_WHEEL_BITS * level);
+    }
+    if (tick < best) {
+      best = tick;
+    }
+  }
+  return best * w->tick_us;
+}
+
+#endif /* UTILS_TIMER_WHEEL_H_ */